@@ -0,0 +1,308 @@
+// Microbenchmarks for the warehouse operations of one drinks_bar stage.
+// The stage source is compiled into this file (its main renamed), so the functions
+// measured are exactly the ones the server runs. Build with -DSTAGE=<n> and
+// -DSTAGE_SOURCE='"../stage<n>/drinks_bar.c"', see the Makefile.
+//
+// Output is tab separated: a "benchmark<TAB>stage<n>" header, then one line per
+// benchmark with the mean time of a single operation in nanoseconds.
+
+#define main drinks_bar_main
+#include STAGE_SOURCE
+#undef main
+
+#include <time.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#define SMALL_STOCK 100ULL        // A few molecules of everything
+#define HUGE_STOCK 100000000ULL   // Large, but still fits the int capacities of stages 3-5
+#define DEFAULT_BUDGET_MS 200     // Time spent on each benchmark (BENCH_MS overrides)
+
+FILE *report;             // Results; stdout itself is sent to /dev/null to swallow the server's output
+int stream_pair[2];       // [0] is handed to the stream handler, [1] plays the client
+int dgram_server = -1;    // UDP socket handed to the datagram handler
+int dgram_client = -1;
+struct sockaddr_in dgram_addr;
+unsigned long long level; // Stock every benchmark starts from (and deliveries are refilled to)
+
+// Adapters: stages 3-5 pass the warehouse around, stage 6 keeps it in a shared mapping
+#if STAGE < 6
+AtomWarehouse bench_warehouse;
+
+void bench_setup()
+{
+}
+
+void bench_teardown()
+{
+}
+
+void bench_fill(unsigned long long amount)
+{
+    bench_warehouse = (AtomWarehouse){ .carbon = amount, .oxygen = amount, .hydrogen = amount };
+}
+
+int bench_add(const char *atom, unsigned long long amount)
+{
+    return add_atoms(&bench_warehouse, atom, amount);
+}
+
+unsigned long long bench_capacity(const char *molecule)
+{
+    return get_amount_of_molecules(&bench_warehouse, molecule);
+}
+
+int bench_deliver(const char *molecule, unsigned long long amount)
+{
+    return deliver_molecules(&bench_warehouse, molecule, amount);
+}
+
+unsigned long long bench_gen(const char *drink)
+{
+    return get_amount_to_gen(&bench_warehouse, drink);
+}
+
+void bench_stream_client(int fd)
+{
+    handle_tcp_or_uds_stream_client(fd, &bench_warehouse);
+}
+
+void bench_udp_client(int fd)
+{
+    handle_udp_client(fd, &bench_warehouse);
+}
+#else
+StreamBuffer bench_stream;
+
+void bench_setup()
+{
+    warehouse = aligned_alloc(_Alignof(SharedWarehouse), sizeof(SharedWarehouse));
+    if (!warehouse)
+    {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(warehouse, 0, sizeof(SharedWarehouse));
+    pthread_mutex_init(&warehouse->write_lock, NULL);
+
+    build_name_index();
+    log_init();
+    log_start(); // Logging costs the same as in the server: formatted into the ring, written by a thread
+}
+
+void bench_teardown()
+{
+    log_stop();
+}
+
+void bench_fill(unsigned long long amount)
+{
+    atomic_store(&warehouse->carbon, amount);
+    atomic_store(&warehouse->oxygen, amount);
+    atomic_store(&warehouse->hydrogen, amount);
+}
+
+int bench_add(const char *atom, unsigned long long amount)
+{
+    return add_atoms(atom, amount);
+}
+
+unsigned long long bench_capacity(const char *molecule)
+{
+    AtomWarehouse stock;
+    unsigned long long amount = 0;
+
+    read_warehouse(&stock);
+    get_amount_of_molecules(&stock, molecule, &amount);
+    return amount;
+}
+
+int bench_deliver(const char *molecule, unsigned long long amount)
+{
+    return deliver_molecules(molecule, amount);
+}
+
+unsigned long long bench_gen(const char *drink)
+{
+    unsigned long long amount = 0;
+
+    get_amount_to_gen(drink, &amount);
+    return amount;
+}
+
+void bench_stream_client(int fd)
+{
+    bench_stream.fd = fd;
+    handle_tcp_or_uds_stream_client(&bench_stream);
+}
+
+void bench_udp_client(int fd)
+{
+    handle_udp_client(fd);
+}
+#endif
+
+// The benchmarked operations, each run once per call
+volatile unsigned long long sink; // Keeps results alive so nothing is optimized away
+
+void op_add()
+{
+    sink += bench_add("CARBON", 1);
+}
+
+void op_capacity_water()
+{
+    sink += bench_capacity("WATER");
+}
+
+void op_capacity_glucose()
+{
+    sink += bench_capacity("GLUCOSE");
+}
+
+// Deliveries would drain the stock, so every one starts from a refilled warehouse
+void op_deliver_water()
+{
+    bench_fill(level);
+    sink += bench_deliver("WATER", 1);
+}
+
+void op_gen_vodka()
+{
+    sink += bench_gen("VODKA");
+}
+
+void op_gen_champagne()
+{
+    sink += bench_gen("CHAMPAGNE");
+}
+
+// The parse paths go through the real handlers: one command per read, like an interactive client
+void op_parse_add()
+{
+    static const char line[] = "ADD CARBON 1\n";
+
+    if (write(stream_pair[1], line, sizeof(line) - 1) != sizeof(line) - 1)
+    {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    bench_stream_client(stream_pair[0]);
+}
+
+void op_parse_deliver()
+{
+    static const char request[] = "DELIVER CARBON DIOXIDE 1";
+    char reply[BUFFER_SIZE];
+
+    bench_fill(level);
+    if (sendto(dgram_client, request, sizeof(request) - 1, 0, (struct sockaddr *)&dgram_addr, sizeof(dgram_addr)) < 0)
+    {
+        perror("sendto");
+        exit(EXIT_FAILURE);
+    }
+    bench_udp_client(dgram_server);
+
+    if (recv(dgram_client, reply, sizeof(reply), 0) < 0) // Every request gets exactly one reply
+    {
+        perror("recv");
+        exit(EXIT_FAILURE);
+    }
+}
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Run op in doubling batches until the budget is spent and report the mean per call
+void run(const char *name, const char *size, void (*op)(), unsigned long long budget_ns)
+{
+    unsigned long long iterations = 0, elapsed = 0;
+
+    bench_fill(level);
+    for (unsigned long long batch = 1; elapsed < budget_ns; batch *= 2)
+    {
+        unsigned long long start = now_ns();
+        for (unsigned long long i = 0; i < batch; i++)
+            op();
+        elapsed += now_ns() - start;
+        iterations += batch;
+    }
+
+    fprintf(report, "%s/%s\t%.1f\n", name, size, (double)elapsed / iterations);
+    fflush(report);
+}
+
+void open_sockets()
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, stream_pair) < 0)
+    {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    dgram_server = socket(AF_INET, SOCK_DGRAM, 0);
+    dgram_client = socket(AF_INET, SOCK_DGRAM, 0);
+    if (dgram_server < 0 || dgram_client < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Any free loopback port
+    socklen_t len = sizeof(dgram_addr);
+    dgram_addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (bind(dgram_server, (struct sockaddr *)&dgram_addr, sizeof(dgram_addr)) < 0 ||
+        getsockname(dgram_server, (struct sockaddr *)&dgram_addr, &len) < 0)
+    {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *budget_env = getenv("BENCH_MS");
+    unsigned long long budget_ns = (budget_env ? strtoull(budget_env, NULL, 10) : DEFAULT_BUDGET_MS) * 1000000ULL;
+
+    // Keep the results on the real stdout, silence everything the server prints
+    int out = dup(STDOUT_FILENO);
+    if (out < 0 || !(report = fdopen(out, "w")) || !freopen("/dev/null", "w", stdout))
+    {
+        perror("stdout");
+        exit(EXIT_FAILURE);
+    }
+
+    open_sockets();
+    bench_setup();
+
+    fprintf(report, "benchmark\tstage%d\n", STAGE);
+
+    const struct { const char *name; unsigned long long amount; } sizes[] = {
+        { "small", SMALL_STOCK },
+        { "huge", HUGE_STOCK }
+    };
+
+    for (int s = 0; s < 2; s++)
+    {
+        level = sizes[s].amount;
+        run("add_atoms", sizes[s].name, op_add, budget_ns);
+        run("capacity_water", sizes[s].name, op_capacity_water, budget_ns);
+        run("capacity_glucose", sizes[s].name, op_capacity_glucose, budget_ns);
+        run("deliver_water", sizes[s].name, op_deliver_water, budget_ns);
+        run("gen_vodka", sizes[s].name, op_gen_vodka, budget_ns);
+        run("gen_champagne", sizes[s].name, op_gen_champagne, budget_ns);
+    }
+
+    level = SMALL_STOCK;
+    run("parse_add", "tcp", op_parse_add, budget_ns);
+    run("parse_deliver", "udp", op_parse_deliver, budget_ns);
+
+    bench_teardown();
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,673 @@
+// End-to-end benchmark: launches drinks_bar once per transport combination (TCP or UDS
+// stream for ADD, UDP or UDS datagram for DELIVER, with and without a save file), drives
+// it with concurrent clients and prints a JSON report to stdout.
+//
+// ADD throughput is taken from the server's stats listener, since ADD has no reply;
+// DELIVER throughput and latency are measured by the clients. CPU time comes from
+// /proc/<pid>/stat and syscalls from the raw_syscalls:sys_enter tracepoint, which needs
+// tracefs mounted (syscalls are reported as null otherwise).
+//
+// Usage: e2e [-b drinks_bar] [-a add clients] [-d deliver clients] [-w window]
+//            [-l lines per write] [-t seconds] [-W warmup ms] [-p base port] [-- server args]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#define BUFFER_SIZE 1024
+#define MAX_WINDOW 1024
+#define LOSS_TIMEOUT_NS 1000000000LL // A DELIVER without a reply after this long is lost
+#define INITIAL_ATOMS "1000000000000" // Stock of every atom at the start of each run
+
+// Settings, shared by all runs
+const char *server_path = "../stage6/drinks_bar";
+int add_clients = 2, deliver_clients = 2, window = 16, lines_per_write = 1;
+int seconds = 2, warmup_ms = 500, base_port = 7400;
+char **server_args = NULL; // Passed through after "--"
+int server_argc = 0;
+
+// One transport combination
+typedef struct
+{
+    bool uds_stream;
+    bool uds_datagram;
+    bool save_file;
+} Run;
+
+// Endpoints of the server under test
+int stream_port, datagram_port;
+char stream_path[108], datagram_path[108], stats_path[108], save_path[108];
+const Run *current;
+
+atomic_bool stopping;  // Clients stop sending
+atomic_bool measuring; // Replies are counted while set
+
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    long long delivered, not_enough, errors, lost;
+    long long *latencies; // ns, measured replies only
+    long long count, capacity;
+} Client;
+
+long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void sleep_ms(int ms)
+{
+    struct timespec wait = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    nanosleep(&wait, NULL);
+}
+
+int connect_stream(const char *path, int port)
+{
+    int fd;
+
+    if (path)
+    {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+    }
+    else
+    {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+// ADD client: streams ADD lines as fast as the server takes them
+void *add_main(void *arg)
+{
+    static const char *atoms[] = { "CARBON", "OXYGEN", "HYDROGEN" };
+    Client *c = arg;
+    char buffer[BUFFER_SIZE * 8];
+
+    int fd = current->uds_stream ? connect_stream(stream_path, 0) : connect_stream(NULL, stream_port);
+    if (fd < 0)
+    {
+        perror("connect (ADD client)");
+        return NULL;
+    }
+
+    for (long long n = 0; !atomic_load(&stopping);)
+    {
+        int len = 0;
+        for (int i = 0; i < lines_per_write; i++, n++)
+            len += snprintf(buffer + len, sizeof(buffer) - len, "ADD %s 1000000\n", atoms[(n + c->id) % 3]);
+
+        if (write(fd, buffer, len) != len)
+        {
+            perror("write (ADD client)");
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+void record_latency(Client *c, long long ns)
+{
+    if (c->count == c->capacity)
+    {
+        c->capacity = c->capacity ? c->capacity * 2 : 4096;
+        c->latencies = realloc(c->latencies, c->capacity * sizeof(long long));
+        if (!c->latencies)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->latencies[c->count++] = ns;
+}
+
+// DELIVER client: keeps `window` tagged requests outstanding. The tag encodes the slot and
+// a per-slot generation, so late replies to requests already counted as lost are ignored.
+void *deliver_main(void *arg)
+{
+    static const char *molecules[] = { "WATER", "CARBON DIOXIDE", "ALCOHOL", "GLUCOSE" };
+    Client *c = arg;
+    long long sent_at[MAX_WINDOW];
+    unsigned long long generation[MAX_WINDOW] = {0};
+    struct sockaddr_storage server = {0};
+    socklen_t server_len;
+    char local_path[108] = "";
+
+    int fd = socket(current->uds_datagram ? AF_UNIX : AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket (DELIVER client)");
+        return NULL;
+    }
+
+    if (current->uds_datagram)
+    {
+        // Datagram replies need a bound address to come back to
+        struct sockaddr_un local = { .sun_family = AF_UNIX };
+        snprintf(local_path, sizeof(local_path), "/tmp/e2e.%d.client%d.socket", getpid(), c->id);
+        strcpy(local.sun_path, local_path);
+        unlink(local_path);
+        if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0)
+        {
+            perror("bind (DELIVER client)");
+            close(fd);
+            return NULL;
+        }
+
+        struct sockaddr_un *addr = (struct sockaddr_un *)&server;
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, datagram_path);
+        server_len = sizeof(*addr);
+    }
+    else
+    {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&server;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(datagram_port);
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        server_len = sizeof(*addr);
+    }
+
+    if (connect(fd, (struct sockaddr *)&server, server_len) < 0)
+    {
+        perror("connect (DELIVER client)");
+        close(fd);
+        return NULL;
+    }
+
+    unsigned long long next = 0;
+    for (int slot = 0; slot < window; slot++)
+        sent_at[slot] = -1;
+
+    while (!atomic_load(&stopping))
+    {
+        char message[BUFFER_SIZE], reply[BUFFER_SIZE];
+
+        // Refill every free slot
+        for (int slot = 0; slot < window; slot++)
+        {
+            if (sent_at[slot] >= 0)
+                continue;
+
+            int len = snprintf(message, sizeof(message), "DELIVER %s 1 #%llu",
+                               molecules[next++ % 4], generation[slot] * window + slot);
+            sent_at[slot] = now_ns();
+            if (send(fd, message, len, 0) < 0)
+            {
+                sent_at[slot] = -1;
+                if (errno == EAGAIN || errno == ENOBUFS)
+                    break; // Socket buffer full, wait for replies first
+                perror("send (DELIVER client)");
+                goto done;
+            }
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        poll(&pfd, 1, 100);
+
+        while (true)
+        {
+            int bytes = recv(fd, reply, sizeof(reply) - 1, MSG_DONTWAIT);
+            if (bytes <= 0)
+                break;
+            reply[bytes] = '\0';
+
+            char *tag = strrchr(reply, '#');
+            if (!tag)
+                continue;
+
+            unsigned long long value = strtoull(tag + 1, NULL, 10);
+            int slot = value % window;
+            if (sent_at[slot] < 0 || value / window != generation[slot])
+                continue; // Already counted as lost
+
+            long long latency = now_ns() - sent_at[slot];
+            sent_at[slot] = -1;
+            generation[slot]++;
+
+            if (!atomic_load(&measuring))
+                continue;
+
+            record_latency(c, latency);
+            if (strncmp(reply, "DELIVERED", 9) == 0)
+                c->delivered++;
+            else if (strncmp(reply, "NOT ENOUGH ATOMS", 16) == 0)
+                c->not_enough++;
+            else
+                c->errors++;
+        }
+
+        // Give up on requests that waited too long
+        long long now = now_ns();
+        for (int slot = 0; slot < window; slot++)
+        {
+            if (sent_at[slot] >= 0 && now - sent_at[slot] > LOSS_TIMEOUT_NS)
+            {
+                sent_at[slot] = -1;
+                generation[slot]++;
+                if (atomic_load(&measuring))
+                    c->lost++;
+            }
+        }
+    }
+
+done:
+    close(fd);
+    if (local_path[0])
+        unlink(local_path);
+    return NULL;
+}
+
+// Sum of the "add <atom> <n>" lines of the server's text stats, -1 if unreachable
+long long fetch_adds()
+{
+    int fd = connect_stream(stats_path, 0);
+    if (fd < 0)
+        return -1;
+
+    char report[8192];
+    size_t len = 0;
+    ssize_t bytes;
+    shutdown(fd, SHUT_WR); // No request: the text format
+    while (len < sizeof(report) - 1 && (bytes = read(fd, report + len, sizeof(report) - 1 - len)) > 0)
+        len += bytes;
+    report[len] = '\0';
+    close(fd);
+
+    long long total = 0;
+    for (char *line = strtok(report, "\n"); line; line = strtok(NULL, "\n"))
+    {
+        char name[32];
+        unsigned long long n;
+        if (sscanf(line, "add %31s %llu", name, &n) == 2 && strcmp(name, "unknown") != 0 && strcmp(name, "invalid") != 0)
+            total += n;
+    }
+    return total;
+}
+
+// User plus system time of all server threads, in microseconds
+long long cpu_us(pid_t pid)
+{
+    char path[64], stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t len = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[len] = '\0';
+
+    // Fields after the command name, which may contain spaces; utime and stime are 14 and 15
+    char *p = strrchr(stat, ')');
+    unsigned long long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return -1;
+
+    return (utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
+
+// Counter of syscalls entered by pid and every thread it creates later, -1 if unavailable
+int open_syscall_counter(pid_t pid)
+{
+    static const char *ids[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+    };
+    unsigned long long id = 0;
+
+    for (int i = 0; i < 2 && !id; i++)
+    {
+        FILE *f = fopen(ids[i], "r");
+        if (f)
+        {
+            if (fscanf(f, "%llu", &id) != 1)
+                id = 0;
+            fclose(f);
+        }
+    }
+    if (!id)
+        return -1;
+
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_TRACEPOINT,
+        .size = sizeof(attr),
+        .config = id,
+        .inherit = 1 // Threads started after this point are counted too
+    };
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+long long read_counter(int fd)
+{
+    long long value;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
+
+// Start the server with this run's endpoints. The child waits on a pipe until the
+// syscall counter is attached, so none of its threads escape it.
+pid_t start_server(int *counter)
+{
+    char ports[2][16], atoms[] = INITIAL_ATOMS;
+    char *argv[64];
+    int argc = 0, gate[2];
+
+    argv[argc++] = (char *)server_path;
+    if (current->uds_stream)
+    {
+        argv[argc++] = "-s";
+        argv[argc++] = stream_path;
+    }
+    else
+    {
+        snprintf(ports[0], sizeof(ports[0]), "%d", stream_port);
+        argv[argc++] = "-T";
+        argv[argc++] = ports[0];
+    }
+    if (current->uds_datagram)
+    {
+        argv[argc++] = "-d";
+        argv[argc++] = datagram_path;
+    }
+    else
+    {
+        snprintf(ports[1], sizeof(ports[1]), "%d", datagram_port);
+        argv[argc++] = "-U";
+        argv[argc++] = ports[1];
+    }
+    if (current->save_file)
+    {
+        argv[argc++] = "-f";
+        argv[argc++] = save_path;
+    }
+    argv[argc++] = "-c";
+    argv[argc++] = atoms;
+    argv[argc++] = "-o";
+    argv[argc++] = atoms;
+    argv[argc++] = "-h";
+    argv[argc++] = atoms;
+    argv[argc++] = "-S";
+    argv[argc++] = stats_path;
+    for (int i = 0; i < server_argc && argc < 63; i++)
+        argv[argc++] = server_args[i];
+    argv[argc] = NULL;
+
+    if (pipe(gate) < 0)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        char go;
+        close(gate[1]);
+        if (read(gate[0], &go, 1) != 1)
+            _exit(EXIT_FAILURE);
+        close(gate[0]);
+
+        // The server's own output would only slow it down on a terminal
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(server_path, argv);
+        _exit(127);
+    }
+
+    *counter = open_syscall_counter(pid);
+    close(gate[0]);
+    if (write(gate[1], "g", 1) != 1)
+        perror("write (gate)");
+    close(gate[1]);
+
+    // Ready once the stats listener, which is opened last, answers
+    for (int i = 0; i < 500; i++)
+    {
+        if (fetch_adds() >= 0)
+            return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break;
+        sleep_ms(10);
+    }
+
+    fprintf(stderr, "%s did not start\n", server_path);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    exit(EXIT_FAILURE);
+}
+
+// The server applies -c/-o/-h only to an in-memory warehouse, so a save file gets the same
+// stock by starting out in the oldest format (the three bare counters), upgraded on open
+void seed_save_file()
+{
+    unsigned long long atoms = strtoull(INITIAL_ATOMS, NULL, 10);
+    unsigned long long counters[3] = { atoms, atoms, atoms }; // Carbon, oxygen, hydrogen
+
+    int fd = open(save_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, counters, sizeof(counters)) != sizeof(counters))
+    {
+        perror("save file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void print_optional(const char *name, double value, bool available, const char *sep)
+{
+    if (available)
+        printf("\"%s\": %.2f%s", name, value, sep);
+    else
+        printf("\"%s\": null%s", name, sep);
+}
+
+void run_once(const Run *run, int index, bool last)
+{
+    current = run;
+    stream_port = base_port + 2 * index;
+    datagram_port = base_port + 2 * index + 1;
+    snprintf(stream_path, sizeof(stream_path), "/tmp/e2e.%d.stream.socket", getpid());
+    snprintf(datagram_path, sizeof(datagram_path), "/tmp/e2e.%d.dgram.socket", getpid());
+    snprintf(stats_path, sizeof(stats_path), "/tmp/e2e.%d.stats.socket", getpid());
+    snprintf(save_path, sizeof(save_path), "/tmp/e2e.%d.dat", getpid());
+    unlink(save_path);
+    if (run->save_file)
+        seed_save_file();
+
+    int counter;
+    pid_t pid = start_server(&counter);
+
+    Client adders[add_clients], deliverers[deliver_clients];
+    memset(adders, 0, sizeof(adders));
+    memset(deliverers, 0, sizeof(deliverers));
+    atomic_store(&stopping, false);
+    atomic_store(&measuring, false);
+
+    for (int i = 0; i < add_clients; i++)
+    {
+        adders[i].id = i;
+        pthread_create(&adders[i].thread, NULL, add_main, &adders[i]);
+    }
+    for (int i = 0; i < deliver_clients; i++)
+    {
+        deliverers[i].id = i;
+        pthread_create(&deliverers[i].thread, NULL, deliver_main, &deliverers[i]);
+    }
+
+    sleep_ms(warmup_ms);
+
+    long long adds_start = fetch_adds(), cpu_start = cpu_us(pid), syscalls_start = read_counter(counter);
+    long long start = now_ns();
+    atomic_store(&measuring, true);
+
+    sleep_ms(seconds * 1000);
+
+    atomic_store(&measuring, false);
+    double elapsed = (now_ns() - start) / 1e9;
+    long long adds_end = fetch_adds(), cpu_end = cpu_us(pid), syscalls_end = read_counter(counter);
+
+    atomic_store(&stopping, true);
+    for (int i = 0; i < add_clients; i++)
+        pthread_join(adders[i].thread, NULL);
+    for (int i = 0; i < deliver_clients; i++)
+        pthread_join(deliverers[i].thread, NULL);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    if (counter >= 0)
+        close(counter);
+    unlink(save_path);
+
+    // Merge the clients
+    long long delivered = 0, not_enough = 0, errors = 0, lost = 0, answered = 0;
+    for (int i = 0; i < deliver_clients; i++)
+    {
+        delivered += deliverers[i].delivered;
+        not_enough += deliverers[i].not_enough;
+        errors += deliverers[i].errors;
+        lost += deliverers[i].lost;
+        answered += deliverers[i].count;
+    }
+
+    long long *latencies = malloc((answered ? answered : 1) * sizeof(long long));
+    for (int i = 0, n = 0; i < deliver_clients; i++)
+    {
+        memcpy(latencies + n, deliverers[i].latencies, deliverers[i].count * sizeof(long long));
+        n += deliverers[i].count;
+        free(deliverers[i].latencies);
+    }
+    qsort(latencies, answered, sizeof(long long), compare_ll);
+
+    long long adds = (adds_start >= 0 && adds_end >= 0) ? adds_end - adds_start : 0;
+    long long requests = adds + answered;
+
+    printf("    {\"stream\": \"%s\", \"datagram\": \"%s\", \"save_file\": %s, \"seconds\": %.3f,\n",
+           run->uds_stream ? "uds" : "tcp", run->uds_datagram ? "uds" : "udp", run->save_file ? "true" : "false", elapsed);
+    printf("     \"add_per_s\": %.0f, \"deliver_per_s\": %.0f, \"delivered\": %lld, \"not_enough\": %lld, \"errors\": %lld, \"lost\": %lld,\n",
+           adds / elapsed, answered / elapsed, delivered, not_enough, errors, lost);
+
+    printf("     \"deliver_latency_us\": {");
+    if (answered)
+        printf("\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f",
+               latencies[(long long)(answered * 0.50)] / 1e3, latencies[(long long)(answered * 0.90)] / 1e3,
+               latencies[(long long)(answered * 0.99)] / 1e3, latencies[(long long)(answered * 0.999)] / 1e3,
+               latencies[answered - 1] / 1e3);
+    printf("},\n     ");
+
+    print_optional("cpu_us_per_request", requests ? (double)(cpu_end - cpu_start) / requests : 0,
+                   requests && cpu_start >= 0 && cpu_end >= 0, ", ");
+    print_optional("syscalls_per_request", requests ? (double)(syscalls_end - syscalls_start) / requests : 0,
+                   requests && syscalls_start >= 0 && syscalls_end >= 0, "");
+    printf("}%s\n", last ? "" : ",");
+    fflush(stdout);
+
+    fprintf(stderr, "%s/%s%s: %.0f ADD/s, %.0f DELIVER/s, p99 %.1f us\n",
+            run->uds_stream ? "uds" : "tcp", run->uds_datagram ? "uds" : "udp", run->save_file ? " +save file" : "",
+            adds / elapsed, answered / elapsed, answered ? latencies[(long long)(answered * 0.99)] / 1e3 : 0);
+    free(latencies);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:a:d:w:l:t:W:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': server_path = optarg; break;
+        case 'a': add_clients = atoi(optarg); break;
+        case 'd': deliver_clients = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'l': lines_per_write = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'W': warmup_ms = atoi(optarg); break;
+        case 'p': base_port = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-b drinks_bar] [-a add clients] [-d deliver clients] [-w window] "
+                            "[-l lines per write] [-t seconds] [-W warmup ms] [-p base port] [-- server args]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (add_clients < 0 || deliver_clients < 0 || window < 1 || window > MAX_WINDOW ||
+        lines_per_write < 1 || lines_per_write > 64 || seconds < 1 || warmup_ms < 0)
+    {
+        fprintf(stderr, "Invalid settings (window 1-%d, lines per write 1-64, at least 1 second)\n", MAX_WINDOW);
+        return EXIT_FAILURE;
+    }
+
+    server_args = argv + optind;
+    server_argc = argc - optind;
+
+    signal(SIGPIPE, SIG_IGN); // A server that dies mid-run shows up as errors, not as our death
+
+    int probe = open_syscall_counter(getpid());
+    if (probe < 0)
+        fprintf(stderr, "Note: syscalls are not counted (mount tracefs and run as root to enable)\n");
+    else
+        close(probe);
+
+    Run runs[8];
+    int count = 0;
+    for (int save = 0; save < 2; save++)
+        for (int stream = 0; stream < 2; stream++)
+            for (int datagram = 0; datagram < 2; datagram++)
+                runs[count++] = (Run){ .uds_stream = stream, .uds_datagram = datagram, .save_file = save };
+
+    printf("{\"server\": \"%s\", \"add_clients\": %d, \"deliver_clients\": %d, \"window\": %d, \"lines_per_write\": %d,\n",
+           server_path, add_clients, deliver_clients, window, lines_per_write);
+    printf(" \"runs\": [\n");
+    for (int i = 0; i < count; i++)
+        run_once(&runs[i], i, i == count - 1);
+    printf(" ]}\n");
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+# Merge the tab separated outputs of the bench_stage* binaries into one table,
+# one column per stage, rows in the order they were first seen
+BEGIN { FS = "\t" }
+
+FNR == 1 { stage[++stages] = $2; next }
+
+{
+    if (!($1 in seen)) {
+        seen[$1] = 1
+        row[++rows] = $1
+    }
+    value[$1, stages] = $2
+}
+
+END {
+    printf "%-26s", "ns/op"
+    for (s = 1; s <= stages; s++)
+        printf "%14s", stage[s]
+    printf "\n"
+
+    for (r = 1; r <= rows; r++) {
+        printf "%-26s", row[r]
+        for (s = 1; s <= stages; s++)
+            printf "%14s", ((row[r], s) in value) ? value[row[r], s] : "-"
+        printf "\n"
+    }
+}
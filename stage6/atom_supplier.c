@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // ppoll
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,79 +10,35 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include "protocol.h"
 
 #define BUFFER_SIZE 1024
+#define MAX_PIPELINE_DEPTH 1024 // Upper bound on commands coalesced into one send() in bulk mode
 
 // Global variables for command line options
 extern int optopt;
 extern char *optarg;
 
-int main(int argc, char *argv[]) {
-    const char *hostname = NULL;
-    const char *port = NULL;
-    char *uds_path = NULL;
-    bool seen_flags[256] = { false }; // Track seen flags to avoid duplicates
-
-    while (1) {
-        int ret = getopt(argc, argv, "h:p:f:");
-
-        if (ret == -1)
-        {
-            break;
-        }
-
-        if (seen_flags[ret])
-        {
-            fprintf(stderr, "Error: Duplicate flag -%c\n", ret);
-            exit(EXIT_FAILURE);
-        }
-        
-        seen_flags[ret] = true; // Mark this flag as seen
-
-        switch (ret) {
-            case 'h':
-                hostname = optarg;
-                break;
-            case 'p':
-                port = optarg;
-                break;
-            case 'f':
-                uds_path = strdup(optarg); // Duplicate the string so it can be used after optarg is modified
-                // Append .socket if not already present
-                if (!strstr(uds_path, ".socket")) {
-                    char *new_path = malloc(strlen(uds_path) + 8); // +8 for ".socket\0"
-                    if (new_path) {
-                        sprintf(new_path, "%s.socket", uds_path);
-                        free(uds_path);
-                        uds_path = new_path;
-                    }
-                }
-                break;    
-            case '?':
-                printf("Usage: %s -h <hostname/IP> -p <port> | -f <unix_socket_path>\n", argv[0]);
-                exit(EXIT_FAILURE);
-        }
-    }
-    char message[BUFFER_SIZE]; // Buffer to hold the message to send
+// Connect a stream socket to the drinks_bar server (UDS if uds_path is set, TCP otherwise)
+int connect_to_server(const char *hostname, const char *port, const char *uds_path, bool verbose) {
     int sockfd;
-    
-    if ((uds_path && (hostname || port)) || (!uds_path && (!hostname || !port))) {
-        fprintf(stderr, "Error: Provide either -f <uds_path> or both -h <hostname> and -p <port>\n");
-        exit(EXIT_FAILURE);
-    }
 
     if (uds_path){
         // Check if the server socket exists
         if (access(uds_path, F_OK) != 0) {
             fprintf(stderr, "Error: Server socket '%s' does not exist\n", uds_path);
-            exit(EXIT_FAILURE);
+            return -1;
         }
 
         sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 
         if (sockfd < 0) {
             perror("socket");
-            exit(EXIT_FAILURE);
+            return -1;
         }
 
         struct sockaddr_un addr;
@@ -92,14 +49,14 @@ int main(int argc, char *argv[]) {
         if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
             perror("connect (UDS)");
             close(sockfd);
-            exit(EXIT_FAILURE);
+            return -1;
         }
 
-        printf("Connected to drinks_bar server via Unix socket: %s\n", uds_path);
+        if (verbose)
+            printf("Connected to drinks_bar server via Unix socket: %s\n", uds_path);
     }
-    
 
-    else if (hostname && port) {
+    else {
         // Resolve hostname
         struct addrinfo hints = {0};
         struct addrinfo *res; // Pointer to hold the resolved address info
@@ -111,7 +68,7 @@ int main(int argc, char *argv[]) {
         // Check if getaddrinfo was successful
         if (status != 0) {
             fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-            return EXIT_FAILURE;
+            return -1;
         }
         
         // Create the socket
@@ -121,7 +78,7 @@ int main(int argc, char *argv[]) {
         if (sockfd < 0) {
             perror("socket");
             freeaddrinfo(res);
-            return EXIT_FAILURE;
+            return -1;
         }
 
         // Connect to the server
@@ -129,16 +86,346 @@ int main(int argc, char *argv[]) {
             perror("connect");
             close(sockfd);
             freeaddrinfo(res);
-            return EXIT_FAILURE;
+            return -1;
         }
         
-        printf("Connected to drinks_bar server at %s:%s (TCP)\n", hostname, port);
+        if (verbose)
+            printf("Connected to drinks_bar server at %s:%s (TCP)\n", hostname, port);
         freeaddrinfo(res); // Free the address info structure after establishing the connection
     }
 
+    return sockfd;
+}
+
+// Monotonic clock in nanoseconds
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Parse an atom mix such as "CARBON=1,OXYGEN=2,HYDROGEN=2" into a repeating pattern of atom ids
+int parse_mix(const char *mix, int *pattern, int max_pattern) {
+    int weights[ATOM_COUNT] = { 0 };
+    char *copy = strdup(mix);
+    int len = 0;
+
+    for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char name[16];
+        int weight = 1;
+
+        if (sscanf(item, "%15[^=]=%d", name, &weight) < 1 || weight < 0) {
+            free(copy);
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < ATOM_COUNT && strcasecmp(name, atom_names[i]) != 0; i++);
+        if (i == ATOM_COUNT) {
+            free(copy);
+            return -1; // Unknown atom type
+        }
+        weights[i] = weight;
+    }
+    free(copy);
+
+    // Interleave the atoms so every window of the pattern follows the mix
+    for (int round = 0; len < max_pattern; round++) {
+        bool added = false;
+        for (int i = 0; i < ATOM_COUNT && len < max_pattern; i++) {
+            if (round < weights[i]) {
+                pattern[len++] = i;
+                added = true;
+            }
+        }
+        if (!added) break;
+    }
+
+    return len > 0 ? len : -1;
+}
+
+// Encode "ADD <ATOM> <amount> [<ATOM> <amount>...]" as binary frames, chained with FRAME_MORE
+// when there are several; returns the total size or -1 if it is not a valid ADD
+int encode_binary_add(const char *message, BinaryFrame *frames) {
+    char command[16], atom[16];
+    unsigned long long amount;
+    int consumed = 0, count = 0;
+
+    if (sscanf(message, "%15s%n", command, &consumed) != 1 || strcmp(command, "ADD") != 0)
+        return -1;
+    message += consumed;
+
+    while (sscanf(message, "%15s %llu%n", atom, &amount, &consumed) == 2) {
+        message += consumed;
+
+        int id;
+        for (id = 0; id < ATOM_COUNT && strcmp(atom, atom_names[id]) != 0; id++);
+        if (id == ATOM_COUNT || count == MAX_ADD_ITEMS)
+            return -1;
+
+        if (count > 0)
+            frames[count - 1].flags = FRAME_MORE;
+
+        BinaryFrame *frame = &frames[count++];
+        memset(frame, 0, sizeof(*frame));
+        frame->magic = BINARY_MAGIC;
+        frame->opcode = OP_ADD;
+        frame->item = id;
+        frame->amount = htole64(amount);
+    }
+
+    // Anything but trailing spaces left over is malformed
+    while (*message == ' ')
+        message++;
+    if (count == 0 || *message != '\0')
+        return -1;
+
+    return count * sizeof(BinaryFrame);
+}
+
+// Non-interactive load generator: streams `count` ADD commands over `connections` connections,
+// `depth` commands per send(), at `rate` commands per second (0 = as fast as possible).
+// Latency is measured per send from the moment it was due on the rate schedule until the
+// kernel accepted all of it, so server backpressure shows up instead of being hidden.
+int run_bulk_mode(const char *hostname, const char *port, const char *uds_path,
+                  long long count, double rate, int connections, int depth, const char *mix, bool binary) {
+    int pattern[64];
+    int pattern_len = parse_mix(mix, pattern, 64);
+    if (pattern_len < 0) {
+        fprintf(stderr, "Error: Invalid atom mix '%s' (expected e.g. CARBON=1,OXYGEN=1,HYDROGEN=2)\n", mix);
+        return EXIT_FAILURE;
+    }
+
+    struct pollfd *fds = calloc(connections, sizeof(struct pollfd));
+    char (*pending)[MAX_PIPELINE_DEPTH * 32] = calloc(connections, sizeof(*pending)); // Unsent part of each connection's batch
+    size_t *pending_len = calloc(connections, sizeof(size_t));
+    size_t *pending_off = calloc(connections, sizeof(size_t));
+    long long *pending_due = calloc(connections, sizeof(long long));
+    long long batches = (count + depth - 1) / depth;
+    long long *latencies = malloc(batches * sizeof(long long));
+
+    if (!fds || !pending || !pending_len || !pending_off || !pending_due || !latencies) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < connections; i++) {
+        fds[i].fd = connect_to_server(hostname, port, uds_path, false);
+        if (fds[i].fd < 0)
+            return EXIT_FAILURE;
+        fcntl(fds[i].fd, F_SETFL, fcntl(fds[i].fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    printf("Sending %lld %s ADD commands over %d connection(s), pipeline depth %d, rate %s\n",
+           count, binary ? "binary" : "text", connections, depth, rate > 0 ? "limited" : "unlimited");
+    if (rate > 0)
+        printf("Target rate: %.0f commands/s\n", rate);
+
+    long long start = now_ns();
+    long long sent = 0, batch = 0, completed = 0, next_atom = 0;
+    int next_conn = 0, busy = 0;
+
+    while (completed < batches) {
+        long long now = now_ns();
+
+        // Start every batch that is due on the schedule, on the next idle connection
+        while (batch < batches && busy < connections) {
+            long long due = rate > 0 ? start + (long long)(batch * depth * 1e9 / rate) : now;
+            if (due > now)
+                break;
+
+            while (pending_len[next_conn] != 0)
+                next_conn = (next_conn + 1) % connections;
+
+            int n = (count - sent < depth) ? (int)(count - sent) : depth;
+            size_t len = 0;
+            for (int k = 0; k < n; k++) {
+                int atom = pattern[next_atom++ % pattern_len];
+
+                if (binary) {
+                    BinaryFrame frame = { .magic = BINARY_MAGIC, .opcode = OP_ADD, .item = atom, .amount = htole64(1) };
+                    memcpy(pending[next_conn] + len, &frame, sizeof(frame));
+                    len += sizeof(frame);
+                }
+                else
+                    len += sprintf(pending[next_conn] + len, "ADD %s 1\n", atom_names[atom]);
+            }
+
+            pending_len[next_conn] = len;
+            pending_off[next_conn] = 0;
+            pending_due[next_conn] = due;
+            fds[next_conn].events = POLLOUT;
+            sent += n;
+            batch++;
+            busy++;
+            next_conn = (next_conn + 1) % connections;
+        }
+
+        // Wait until a connection can take more data or the next batch is due
+        long long wait_ns = 100000000;
+        if (batch < batches && busy < connections && rate > 0) {
+            wait_ns = start + (long long)(batch * depth * 1e9 / rate) - now_ns();
+            if (wait_ns < 0) wait_ns = 0;
+        }
+        struct timespec wait = { .tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000 };
+
+        if (ppoll(fds, busy ? connections : 0, &wait, NULL) < 0) {
+            perror("ppoll");
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < connections; i++) {
+            if (!(fds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+                continue;
+
+            ssize_t res = send(fds[i].fd, pending[i] + pending_off[i], pending_len[i] - pending_off[i], MSG_NOSIGNAL);
+            if (res < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    continue;
+                perror("send");
+                return EXIT_FAILURE;
+            }
+
+            pending_off[i] += res;
+            if (pending_off[i] == pending_len[i]) {
+                latencies[completed++] = now_ns() - pending_due[i];
+                pending_len[i] = 0;
+                fds[i].events = 0;
+                busy--;
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < connections; i++)
+        close(fds[i].fd);
+
+    qsort(latencies, batches, sizeof(long long), compare_ll);
+
+    printf("Sent %lld commands in %.3f s: %.0f commands/s\n", sent, elapsed, sent / elapsed);
+    printf("Send latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           latencies[(long long)(batches * 0.50)] / 1e3,
+           latencies[(long long)(batches * 0.90)] / 1e3,
+           latencies[(long long)(batches * 0.99)] / 1e3,
+           latencies[(long long)(batches * 0.999)] / 1e3,
+           latencies[batches - 1] / 1e3);
+
+    free(fds);
+    free(pending);
+    free(pending_len);
+    free(pending_off);
+    free(pending_due);
+    free(latencies);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *hostname = NULL;
+    const char *port = NULL;
+    char *uds_path = NULL;
+    bool seen_flags[256] = { false }; // Track seen flags to avoid duplicates
+    long long count = 0; // Number of ADD commands to send in bulk mode (0 = interactive)
+    double rate = 0;
+    int connections = 1, depth = 1;
+    const char *mix = "CARBON=1,OXYGEN=1,HYDROGEN=1";
+    bool binary = false; // Speak the binary protocol instead of text
+
+    struct option long_options[] = {
+        {"count", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"connections", required_argument, NULL, 'c'},
+        {"pipeline-depth", required_argument, NULL, 'D'},
+        {"mix", required_argument, NULL, 'm'},
+        {"binary", no_argument, NULL, 'b'},
+        {0, 0, 0, 0}};
+
+    while (1) {
+        int ret = getopt_long(argc, argv, "h:p:f:n:r:c:D:m:b", long_options, NULL);
+
+        if (ret == -1)
+        {
+            break;
+        }
+
+        if (seen_flags[ret])
+        {
+            fprintf(stderr, "Error: Duplicate flag -%c\n", ret);
+            exit(EXIT_FAILURE);
+        }
+        
+        seen_flags[ret] = true; // Mark this flag as seen
+
+        switch (ret) {
+            case 'h':
+                hostname = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'f':
+                uds_path = strdup(optarg); // Duplicate the string so it can be used after optarg is modified
+                // Append .socket if not already present
+                if (!strstr(uds_path, ".socket")) {
+                    char *new_path = malloc(strlen(uds_path) + 8); // +8 for ".socket\0"
+                    if (new_path) {
+                        sprintf(new_path, "%s.socket", uds_path);
+                        free(uds_path);
+                        uds_path = new_path;
+                    }
+                }
+                break;    
+            case 'n':
+                count = atoll(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'D':
+                depth = atoi(optarg);
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 'b':
+                binary = true;
+                break;
+            case '?':
+                printf("Usage: %s -h <hostname/IP> -p <port> | -f <unix_socket_path>\n", argv[0]);
+                printf("Bulk mode: [--count N] [--rate CMDS_PER_SEC] [--connections N] [--pipeline-depth N] [--mix CARBON=1,OXYGEN=1,HYDROGEN=1] [--binary]\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+    char message[BUFFER_SIZE]; // Buffer to hold the message to send
+    
+    if ((uds_path && (hostname || port)) || (!uds_path && (!hostname || !port))) {
+        fprintf(stderr, "Error: Provide either -f <uds_path> or both -h <hostname> and -p <port>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (count > 0) {
+        if (connections < 1 || depth < 1 || depth > MAX_PIPELINE_DEPTH || rate < 0) {
+            fprintf(stderr, "Error: --connections must be >= 1, --pipeline-depth between 1 and %d and --rate >= 0\n", MAX_PIPELINE_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        return run_bulk_mode(hostname, port, uds_path, count, rate, connections, depth, mix, binary);
+    }
+
+    int sockfd = connect_to_server(hostname, port, uds_path, true);
+    if (sockfd < 0)
+        return EXIT_FAILURE;
+
     // Main loop to read commands from the user with persistent connection
     while (1) {
-        printf("Enter a command (e.g., ADD HYDROGEN 3) or type \"q\" to quit:\n> ");
+        printf("Enter a command (e.g., ADD HYDROGEN 3 or ADD CARBON 5 OXYGEN 10 HYDROGEN 20) or type \"q\" to quit:\n> ");
         
         if (!fgets(message, BUFFER_SIZE, stdin)) break; // Read user input (break on EOF)
 
@@ -148,8 +435,26 @@ int main(int argc, char *argv[]) {
 
         if (strcasecmp(message, "q") == 0) break; // Exit if the user types "q"
 
+        if (binary) {
+            // Encode the command as frames instead of sending the text
+            BinaryFrame frames[MAX_ADD_ITEMS];
+            int size = encode_binary_add(message, frames);
+            if (size < 0) {
+                fprintf(stderr, "Invalid command for the binary protocol (expected ADD <ATOM> <amount> [<ATOM> <amount>...])\n");
+                continue;
+            }
+            memcpy(message, frames, size);
+            len = size;
+        }
+
+        else {
+            // Commands are newline-delimited on the stream, so terminate each one
+            len = strlen(message);
+            message[len++] = '\n';
+        }
+
         // Send the message to the server using the persistent connection
-        if (send(sockfd, message, strlen(message), 0) < 0) {
+        if (send(sockfd, message, len, 0) < 0) {
             // If send fails, the connection might be broken
             if (errno == EPIPE || errno == ECONNRESET) {
                 fprintf(stderr, "Connection lost. Server may have closed the connection.\n");
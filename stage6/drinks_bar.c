@@ -1,21 +1,61 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <sys/epoll.h> // epoll_create1, epoll_ctl, epoll_wait
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h> // atomic_fetch_add, atomic_compare_exchange_weak
 #include <signal.h>
 #include <getopt.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include <limits.h> // ULLONG_MAX, LLONG_MAX
 #include <sys/file.h>
 #include <fcntl.h> // fcntl, open, struct flock
 #include <sys/mman.h> // mmap, munmap
 #include <sys/stat.h> // ftruncate, S_IRUSR and such
 #include <sys/types.h> // off_t and such
+#include <sys/uio.h> // readv, struct iovec
+#include <sys/eventfd.h> // eventfd, wakes a loop from the publisher thread
+#include <endian.h> // htole64, le64toh
+#include <sys/syscall.h> // SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register, SYS_futex
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <linux/io_uring.h> // io_uring ABI, used through raw syscalls
+#include <time.h> // clock_gettime, nanosleep
+#include <stdarg.h> // va_list for log_msg
+#include <stddef.h> // offsetof
+#include <libgen.h> // dirname
+#include "protocol.h"
 
 #define BUFFER_SIZE 1024 // Size of the buffer for reading client requests
+#define DGRAM_BATCH 64 // Datagrams drained per recvmmsg call
+#define STREAM_BUFFER_SIZE 4096 // Size of the per-connection ring buffer for stream clients (power of two)
+#define DEFAULT_HIGH_WATER 65536 // Queued reply bytes after which a stream client is no longer read
+
+// Per-connection buffers of a stream client. Commands are newline-delimited and may arrive
+// coalesced or split across reads, so partial tails are kept in a ring until the rest arrives.
+// Replies the socket does not take right away are queued and sent once it is writable again.
+typedef struct
+{
+    int fd;
+    char data[STREAM_BUFFER_SIZE];
+    size_t head; // Position of the first unparsed byte (free-running, masked on access)
+    size_t scan; // Position up to which no newline was found yet
+    size_t tail; // Position one past the last received byte
+    bool skip_batch; // Dropping the rest of an overlong binary ADD batch
+    bool skip_line;  // Dropping the rest of an overlong text command
+
+    char *out;         // Queued output, grown on demand
+    size_t out_head;   // First unsent byte
+    size_t out_len;    // One past the last queued byte
+    size_t out_size;   // Allocated size of out
+    _Atomic bool push_due; // The publisher asked for an inventory push (subscribers only)
+} StreamBuffer;
 
 // Global variables
 extern int optopt;
@@ -23,9 +63,109 @@ extern char *optarg;
 int tcp_listener = -1, udp_listener = -1;
 int uds_stream_listener = -1, uds_dgram_fd = -1;
 char *stream_path = NULL, *datagram_path = NULL; // Paths for UDS sockets
+int stats_listener = -1;
+char *stats_path = NULL; // UDS path of the stats listener, if it is not a TCP port
+bool stats_enabled = false; // Instrumentation is only recorded when someone can read it
+
+// When changes to the save file mapping are forced to disk (--sync-mode)
+typedef enum
+{
+    SYNC_NONE,     // Whenever the kernel writes the pages back
+    SYNC_INTERVAL, // Every sync_arg ms, from a background thread
+    SYNC_BATCH,    // After every sync_arg operations
+    SYNC_EVERY     // After every operation
+} SyncMode;
+
+static const char *const sync_mode_names[] = { "none", "interval", "batch", "every" };
+SyncMode sync_mode = SYNC_NONE;
+int sync_arg = 0;
 struct pollfd *fds = NULL; // Array of file descriptors for polling
-int nfds = 3; // Number of valid file descriptors;
-int running = 1;
+StreamBuffer **fd_buffers = NULL; // Buffers of the stream clients, parallel to fds
+#define POLL_CLIENTS 4 // fds[0..3] are the stream listener, the datagram socket, stdin and the wake-up eventfd
+int nfds = POLL_CLIENTS; // Number of valid file descriptors;
+atomic_int running = 1; // Cleared by SIGINT, SIGTERM or SIGALRM, polled by every thread
+atomic_int timed_out = 0; // Set by SIGALRM when no client was active for --timeout seconds
+size_t high_water = DEFAULT_HIGH_WATER; // --high-water
+
+// Event loop backends
+typedef enum
+{
+    LOOP_POLL,    // poll() over the fds array
+    LOOP_EPOLL,   // Level-triggered epoll
+    LOOP_EPOLL_ET, // Edge-triggered epoll
+    LOOP_URING    // io_uring with multishot accept/recv
+} EventLoopType;
+
+typedef enum
+{
+    CONN_STREAM_LISTENER, // TCP or UDS stream listener
+    CONN_UDP,             // UDP socket
+    CONN_UDS_DATAGRAM,    // UDS datagram socket
+    CONN_STDIN,           // Standard input for GEN commands
+    CONN_CLIENT,          // Accepted atom_supplier connection
+    CONN_WAKE             // The loop's wake-up eventfd, written by the publisher thread
+} ConnectionType;
+
+// Per-descriptor state for the epoll backend, kept in a doubly linked list so it can be removed in O(1)
+typedef struct Connection
+{
+    int fd;
+    ConnectionType type;
+    StreamBuffer *in; // Input and output buffers (CONN_CLIENT only)
+    uint32_t events;  // Events registered with epoll
+    // io_uring clients: the requests in flight, which must all complete before the state is freed
+    unsigned ops;
+    bool receiving, cancelling, polling_out, closing;
+    struct Connection *prev, *next;
+} Connection;
+
+// Each worker thread runs its own epoll loop, so the loop state is thread-local
+__thread int epoll_fd = -1; // epoll instance (epoll backend only)
+__thread Connection *connections = NULL; // Head of the list of registered connections (epoll and io_uring backends)
+__thread int wake_fd = -1; // eventfd the publisher writes when a subscriber of this loop is due a push
+
+#define URING_ENTRIES 256 // Submission queue size
+#define URING_BUFFERS 256 // Provided receive buffers shared by all stream clients of a ring (power of two)
+#define URING_BUFFER_SIZE 2048 // Size of each provided buffer
+
+// A minimal io_uring: the kernel-shared rings mapped from the ring descriptor,
+// plus a provided buffer ring the kernel picks stream receive buffers from
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_local_tail; // Entries queued but not yet published to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;           // URING_BUFFERS * URING_BUFFER_SIZE bytes
+    unsigned short buf_tail; // Next free slot of buf_ring
+} Uring;
+
+__thread Uring ring = { .fd = -1 }; // io_uring instance (io_uring backend only)
+
+void uring_free(Uring *r);
+void journal_stop();
+void watcher_stop();
+void publisher_stop();
+void sync_stop();
+void close_save_file();
+void free_stream_buffer(StreamBuffer *in);
+
+// Per-thread event loop configuration for --threads mode
+typedef struct
+{
+    pthread_t thread;
+    int stream_fd;       // This worker's TCP listener, or the shared UDS stream listener
+    int dgram_fd;        // This worker's UDP socket, or the shared UDS datagram socket
+    int timeout;
+    bool edge_triggered;
+    bool uring;          // Run the io_uring loop instead of epoll
+} Worker;
 
 typedef struct
 {
@@ -34,530 +174,3934 @@ typedef struct
     unsigned long long hydrogen;
 } AtomWarehouse;
 
-AtomWarehouse *warehouse = NULL; // will point to mapped memory
+// Save file format. Version 0 files are the three bare counters, version 1 files are the
+// SharedWarehouse below without the header, version 2 files lack the doorbell and
+// version 3 files lack the journal generation in the header.
+// All of them are upgraded in place by the first process.
+#define WAREHOUSE_MAGIC 0x524142534b4e4944ULL // "DINKSBAR"
+#define WAREHOUSE_VERSION 4
+#define WAREHOUSE_ATOM_SLOTS 8      // Counter slots, room for atoms added later
+#define WAREHOUSE_MOLECULE_SLOTS 16 // Per-molecule extension slots
+#define V1_FILE_SIZE 128
+#define V1_COUNTERS_OFFSET 64
+#define V2_COUNTERS_OFFSET 128
+#define V3_COUNTERS_OFFSET 192
+#define V2_HEADER_CRC_OFFSET 40 // Versions 2 and 3 keep header_crc right after data_crc
+
+typedef struct
+{
+    uint64_t magic;          // WAREHOUSE_MAGIC
+    uint32_t version;        // WAREHOUSE_VERSION of the process that created or upgraded the file
+    uint32_t header_size;    // sizeof(WarehouseHeader)
+    uint64_t file_size;      // sizeof(SharedWarehouse)
+    uint32_t atom_slots;     // WAREHOUSE_ATOM_SLOTS
+    uint32_t molecule_slots; // WAREHOUSE_MOLECULE_SLOTS
+    uint32_t clean;          // Set by the last process to close the file, cleared while in use
+    uint32_t data_crc;       // CRC-32 of the counters, only meaningful while clean is set
+    uint64_t journal_generation; // First journal generation of the current run, 0 if it runs without --journal
+    uint32_t header_crc;     // CRC-32 of all the fields above
+} WarehouseHeader;
+
+// The live warehouse. With --save-file this struct is the file itself, mapped by every
+// process sharing it, so the coordination words live in the mapping next to the counters.
+typedef struct
+{
+    WarehouseHeader header; // Written only when the file is created, opened first or closed last
+
+    _Alignas(64) _Atomic unsigned long long seq; // Seqlock version word: odd while a delivery is debiting atoms
+    pthread_mutex_t write_lock;     // Robust futex lock serializing deliveries (process-shared with a save file)
+
+    // Change notification: bumped after every change, and a futex for the watcher of every process
+    _Alignas(64) _Atomic uint32_t doorbell;
+    _Atomic uint32_t doorbell_armed; // Set by watchers about to sleep, so writers only wake when someone waits
+    _Atomic uint64_t changes; // Bumped with the doorbell, but too wide to wrap: identifies a state for caches
+
+    // Counters start on their own cache line so readers spinning on them don't bounce the lock
+    _Alignas(64) _Atomic unsigned long long carbon;
+    _Atomic unsigned long long oxygen;
+    _Atomic unsigned long long hydrogen;
+    _Atomic unsigned long long atom_ext[WAREHOUSE_ATOM_SLOTS - ATOM_COUNT]; // Zero until new atoms use them
+
+    _Alignas(64) unsigned long long molecule_ext[WAREHOUSE_MOLECULE_SLOTS]; // Reserved, zero
+} SharedWarehouse;
+
+SharedWarehouse *warehouse = NULL; // will point to mapped memory
 int fd = -1; // file descriptor for the save file
 char *save_file_path = NULL; // path to the shared file (if provided)
 
-// Clean up: close all client sockets and free resources
-void cleanup()
-{
-    for (int i = 0; i < nfds; i++)
-    {
-        if (fds[i].fd >= 0)
-        {
-            close(fds[i].fd); // Close each socket
+// Logging: request handlers format a line into a slot of a lock-free ring and move on,
+// a writer thread hands the lines to stdout in batches. If stdout stalls the ring fills up
+// and further lines are dropped (and counted) instead of blocking the event loops.
+typedef enum
+{
+    LOG_ALWAYS, // Answers to stdin commands, never filtered
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+#define LOG_SLOTS 4096 // Lines the ring can hold (power of two)
+#define LOG_LINE_SIZE 256 // Longer lines are truncated
+#define LOG_BATCH 64 // Lines written per writev
+
+typedef struct
+{
+    _Atomic unsigned long seq; // == position when free, position + 1 once filled
+    unsigned int len;
+    char text[LOG_LINE_SIZE];
+} LogSlot;
+
+static LogSlot log_ring[LOG_SLOTS];
+static _Atomic unsigned long log_head;     // Next position producers claim
+static unsigned long log_tail;             // Next position the writer drains (writer only)
+static _Atomic unsigned long log_dropped;  // Lines lost because the ring was full
+static atomic_bool log_stopping;
+static pthread_t log_thread;
+static bool log_started = false;
+LogLevel log_level = LOG_INFO;
+
+void log_init()
+{
+    for (unsigned long i = 0; i < LOG_SLOTS; i++)
+        atomic_init(&log_ring[i].seq, i);
+}
+
+// Queue one line (a newline is appended). Safe from any thread, never blocks.
+void log_msg(LogLevel level, const char *format, ...)
+{
+    if (level > log_level)
+        return;
+
+    unsigned long pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    LogSlot *slot;
+
+    // Claim a free slot (bounded MPMC queue: a slot is free when its seq equals the position)
+    for (;;)
+    {
+        slot = &log_ring[pos & (LOG_SLOTS - 1)];
+        long diff = (long)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return; // Full: the writer has not caught up
+        }
+        else
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(slot->text, LOG_LINE_SIZE - 1, format, args);
+    va_end(args);
+
+    if (len < 0)
+        len = 0;
+    if (len > LOG_LINE_SIZE - 2)
+        len = LOG_LINE_SIZE - 2;
+    slot->text[len++] = '\n';
+    slot->len = len;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Write every iovec, resuming after partial writes
+void write_all(int out, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(out, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return; // stdout is gone, nothing sensible left to do with the lines
+        }
+
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+void *log_writer_main(void *arg)
+{
+    struct iovec iov[LOG_BATCH];
+
+    for (;;)
+    {
+        unsigned long start = log_tail;
+        int count = 0;
+
+        while (count < LOG_BATCH)
+        {
+            LogSlot *slot = &log_ring[log_tail & (LOG_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_tail + 1)
+                break; // Not filled yet
+
+            iov[count].iov_base = slot->text;
+            iov[count].iov_len = slot->len;
+            count++;
+            log_tail++;
+        }
+
+        if (count > 0)
+        {
+            write_all(STDOUT_FILENO, iov, count);
+
+            // Hand the slots back to the producers for the next lap of the ring
+            for (unsigned long pos = start; pos != log_tail; pos++)
+                atomic_store_explicit(&log_ring[pos & (LOG_SLOTS - 1)].seq, pos + LOG_SLOTS, memory_order_release);
+        }
+
+        unsigned long dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+        if (dropped)
+        {
+            char note[64];
+            struct iovec line = { note, snprintf(note, sizeof(note), "[log] %lu lines dropped\n", dropped) };
+            write_all(STDOUT_FILENO, &line, 1);
+        }
+
+        if (count == 0)
+        {
+            if (atomic_load(&log_stopping))
+                break; // Drained after the stop request
+
+            struct timespec idle = { .tv_nsec = 1000000 };
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+// Start the writer thread; stdout must not be written through stdio until log_stop()
+void log_start()
+{
+    fflush(stdout);
+    atomic_store(&log_stopping, false);
+
+    if (pthread_create(&log_thread, NULL, log_writer_main, NULL) != 0)
+    {
+        perror("pthread_create (log writer)");
+        exit(EXIT_FAILURE);
+    }
+    log_started = true;
+}
+
+// Write out everything queued so far and stop the writer. A stalled stdout gets
+// one second, so shutdown never hangs on the log collector.
+void log_stop()
+{
+    struct timespec deadline;
+
+    if (!log_started)
+        return;
+
+    atomic_store(&log_stopping, true);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+
+    if (pthread_timedjoin_np(log_thread, NULL, &deadline) != 0)
+    {
+        // Still blocked in writev: abandon the remaining lines, and stdout with them,
+        // so the final messages cannot block either
+        pthread_detach(log_thread);
+        freopen("/dev/null", "w", stdout);
+    }
+    log_started = false;
+}
+
+// Close and free every connection of this thread's epoll loop (listeners only if close_listeners)
+void free_connections(bool close_listeners)
+{
+    while (connections != NULL)
+    {
+        Connection *next = connections->next;
+        if (connections->type == CONN_CLIENT || connections->type == CONN_WAKE ||
+            (close_listeners && connections->type != CONN_STDIN))
+            close(connections->fd); // Close each socket
+        free_stream_buffer(connections->in);
+        free(connections);
+        connections = next;
+    }
+
+    if (epoll_fd >= 0)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+    wake_fd = -1; // Closed with its connection (or with fds by the poll backend)
+
+    if (ring.fd >= 0)
+        uring_free(&ring);
+}
+
+// Clean up: close all client sockets and free resources
+void cleanup()
+{
+    watcher_stop(); // Before the warehouse it sleeps on is unmapped or freed
+    publisher_stop(); // Likewise, and before the wake-up eventfds it writes are closed
+    sync_stop(); // No background msync may race the final one and the seal in close_save_file()
+    journal_stop(); // Make every journaled operation durable
+    log_stop(); // Flush pending log lines before anything else is printed
+
+    if (fds != NULL)
+    {
+        for (int i = 0; i < nfds; i++)
+        {
+            if (fds[i].fd >= 0)
+            {
+                close(fds[i].fd); // Close each socket
+            }
+        }
+        free(fds); // Free the allocated memory for file descriptors
+
+        for (int i = POLL_CLIENTS; i < nfds; i++)
+            free_stream_buffer(fd_buffers[i]);
+        free(fd_buffers);
+    }
+
+    free_connections(true);
+
+    if (stream_path)
+        unlink(stream_path); // Remove the UDS stream socket file
+    
+    if (datagram_path)
+        unlink(datagram_path); // Remove the UDS datagram socket file
+
+    if (stats_path)
+        unlink(stats_path); // Remove the stats socket file
+
+    if (save_file_path) {
+    if (warehouse && warehouse != MAP_FAILED) {
+        close_save_file();
+        munmap(warehouse, sizeof(SharedWarehouse));
+    }
+    close(fd);
+    }
+    
+    else {
+        free(warehouse);
+    }
+}
+
+// Signal handler for graceful shutdown
+void handle_signal(int sig)
+{
+    atomic_store(&running, 0);
+}
+
+// Only flags the shutdown: the loops notice within a second and main cleans up, since
+// cleanup() takes locks and joins threads that the interrupted thread may hold
+void handle_timeout(int sig)
+{
+    atomic_store(&timed_out, 1);
+    atomic_store(&running, 0);
+}
+
+// Take a consistent copy of the warehouse, retrying if a delivery was debiting meanwhile
+void read_warehouse(AtomWarehouse *stock)
+{
+    unsigned long long seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&warehouse->seq, memory_order_acquire);
+        stock->carbon = atomic_load_explicit(&warehouse->carbon, memory_order_relaxed);
+        stock->oxygen = atomic_load_explicit(&warehouse->oxygen, memory_order_relaxed);
+        stock->hydrogen = atomic_load_explicit(&warehouse->hydrogen, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&warehouse->seq, memory_order_relaxed));
+}
+
+// Take the write lock and make the version odd so this thread is the only one debiting atoms.
+// Uncontended this is a single CAS in user space; contended writers sleep on the futex.
+unsigned long long begin_delivery()
+{
+    if (pthread_mutex_lock(&warehouse->write_lock) == EOWNERDEAD)
+    {
+        // A process died mid-delivery: close its odd version and take over the lock
+        if (atomic_load_explicit(&warehouse->seq, memory_order_relaxed) & 1)
+            atomic_fetch_add_explicit(&warehouse->seq, 1, memory_order_relaxed);
+        pthread_mutex_consistent(&warehouse->write_lock);
+    }
+
+    unsigned long long seq = atomic_load_explicit(&warehouse->seq, memory_order_relaxed);
+    atomic_store_explicit(&warehouse->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // Readers must see the odd version before any debit
+
+    return seq;
+}
+
+// Publish the new version and release the write lock; readers only retry if atoms were debited
+void end_delivery(unsigned long long seq, bool debited)
+{
+    atomic_store_explicit(&warehouse->seq, debited ? seq + 2 : seq, memory_order_release);
+    pthread_mutex_unlock(&warehouse->write_lock);
+}
+
+// Instrumentation, served by the stats listener (--stats). Everything is a relaxed atomic,
+// shared by all threads of this process, and nothing is recorded unless stats are enabled.
+#define HIST_SUB_BITS 3 // 8 linear sub-buckets per power of two, so values are within 12.5%
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct
+{
+    _Atomic unsigned long long count;
+    _Atomic unsigned long long max;
+    _Atomic unsigned long long buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct
+{
+    _Atomic unsigned long long adds[ATOM_COUNT]; // Successful ADDs per atom
+    _Atomic unsigned long long add_unknown;      // ADD of an unknown atom
+    _Atomic unsigned long long add_invalid;      // Unparsable stream commands
+    _Atomic unsigned long long delivered[MOLECULE_COUNT];
+    _Atomic unsigned long long not_enough[MOLECULE_COUNT];
+    _Atomic unsigned long long deliver_unknown;  // DELIVER of an unknown molecule
+    _Atomic unsigned long long deliver_invalid;  // Unparsable datagram requests
+    _Atomic unsigned long long gen_requests;
+    _Atomic unsigned long long accepted;         // Stream connections accepted
+    _Atomic unsigned long long closed;           // Stream connections closed
+    _Atomic unsigned long long subscribed;       // SUBSCRIBE commands that added a subscriber
+    _Atomic unsigned long long unsubscribed;     // Subscribers removed again
+    _Atomic unsigned long long pushes;           // Inventory lines pushed to subscribers
+    _Atomic unsigned long long push_skipped;     // Pushes merged into one a slow subscriber had not taken yet
+    Histogram parse;     // Parsing a text command (ns)
+    Histogram warehouse; // Applying an ADD or DELIVER to the warehouse (ns)
+    Histogram reply;     // Sending a batch of datagram replies (ns)
+    Histogram loop;      // Handling everything one event loop wakeup reported (ns)
+    Histogram sync;      // One msync of the save file mapping (ns)
+} Stats;
+
+Stats stats;
+
+void stat_inc(_Atomic unsigned long long *counter)
+{
+    if (stats_enabled)
+        atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Current monotonic time in ns, or 0 when stats are disabled (which makes stats_lap a no-op)
+unsigned long long stats_now()
+{
+    return stats_enabled ? monotonic_ns() : 0;
+}
+
+int hist_index(unsigned long long value)
+{
+    if (value < (1 << HIST_SUB_BITS))
+        return value;
+
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that falls into bucket i
+unsigned long long hist_upper_bound(int i)
+{
+    if (i < (1 << HIST_SUB_BITS))
+        return i;
+
+    int shift = (i >> HIST_SUB_BITS) - 1;
+    unsigned long long lower = (unsigned long long)((1 << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+void hist_record(Histogram *h, unsigned long long value)
+{
+    atomic_fetch_add_explicit(&h->buckets[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// Record the time since start into h and return the current time, so stages can be chained
+unsigned long long stats_lap(Histogram *h, unsigned long long start)
+{
+    if (!start)
+        return 0;
+
+    unsigned long long now = stats_now();
+    hist_record(h, now - start);
+    return now;
+}
+
+// Value below which the given fraction of the samples fall (bucket upper bound, capped at the max)
+unsigned long long hist_percentile(const Histogram *h, double fraction)
+{
+    unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    unsigned long long seen = 0;
+
+    if (count == 0)
+        return 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= fraction * count)
+            return hist_upper_bound(i) < max ? hist_upper_bound(i) : max;
+    }
+    return max;
+}
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+
+void write_histogram_text(FILE *out, const char *name, const Histogram *h)
+{
+    fprintf(out, "latency_ns %s count %llu p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n", name, LOAD(h->count),
+            hist_percentile(h, 0.5), hist_percentile(h, 0.9), hist_percentile(h, 0.99), hist_percentile(h, 0.999), LOAD(h->max));
+}
+
+void write_histogram_json(FILE *out, const char *name, const Histogram *h, bool last)
+{
+    fprintf(out, "    \"%s\": {\"count\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"max\": %llu, \"buckets\": [",
+            name, LOAD(h->count), hist_percentile(h, 0.5), hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+            hist_percentile(h, 0.999), LOAD(h->max));
+
+    // Only non-empty buckets, as [upper bound, count] pairs
+    bool first = true;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        unsigned long long n = LOAD(h->buckets[i]);
+        if (n)
+        {
+            fprintf(out, "%s[%llu, %llu]", first ? "" : ", ", hist_upper_bound(i), n);
+            first = false;
+        }
+    }
+    fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+void write_stats_text(FILE *out)
+{
+    for (int i = 0; i < ATOM_COUNT; i++)
+        fprintf(out, "add %s %llu\n", atom_names[i], LOAD(stats.adds[i]));
+    fprintf(out, "add unknown %llu\n", LOAD(stats.add_unknown));
+    fprintf(out, "add invalid %llu\n", LOAD(stats.add_invalid));
+
+    for (int i = 0; i < MOLECULE_COUNT; i++)
+        fprintf(out, "deliver %s delivered %llu not_enough %llu\n", molecule_names[i], LOAD(stats.delivered[i]), LOAD(stats.not_enough[i]));
+    fprintf(out, "deliver unknown %llu\n", LOAD(stats.deliver_unknown));
+    fprintf(out, "deliver invalid %llu\n", LOAD(stats.deliver_invalid));
+    fprintf(out, "gen %llu\n", LOAD(stats.gen_requests));
+
+    unsigned long long accepted = LOAD(stats.accepted), closed = LOAD(stats.closed);
+    fprintf(out, "connections accepted %llu open %llu\n", accepted, accepted - closed);
+
+    unsigned long long subscribed = LOAD(stats.subscribed), unsubscribed = LOAD(stats.unsubscribed);
+    fprintf(out, "subscribers active %llu pushes %llu skipped %llu\n", subscribed - unsubscribed, LOAD(stats.pushes), LOAD(stats.push_skipped));
+    fprintf(out, "sync mode %s\n", sync_mode_names[sync_mode]);
+
+    write_histogram_text(out, "parse", &stats.parse);
+    write_histogram_text(out, "warehouse", &stats.warehouse);
+    write_histogram_text(out, "reply", &stats.reply);
+    write_histogram_text(out, "loop", &stats.loop);
+    write_histogram_text(out, "sync", &stats.sync);
+}
+
+void write_stats_json(FILE *out)
+{
+    fprintf(out, "{\n  \"add\": {");
+    for (int i = 0; i < ATOM_COUNT; i++)
+        fprintf(out, "\"%s\": %llu, ", atom_names[i], LOAD(stats.adds[i]));
+    fprintf(out, "\"unknown\": %llu, \"invalid\": %llu},\n", LOAD(stats.add_unknown), LOAD(stats.add_invalid));
+
+    fprintf(out, "  \"deliver\": {");
+    for (int i = 0; i < MOLECULE_COUNT; i++)
+        fprintf(out, "\"%s\": {\"delivered\": %llu, \"not_enough\": %llu}, ", molecule_names[i], LOAD(stats.delivered[i]), LOAD(stats.not_enough[i]));
+    fprintf(out, "\"unknown\": %llu, \"invalid\": %llu},\n", LOAD(stats.deliver_unknown), LOAD(stats.deliver_invalid));
+    fprintf(out, "  \"gen\": %llu,\n", LOAD(stats.gen_requests));
+
+    unsigned long long accepted = LOAD(stats.accepted), closed = LOAD(stats.closed);
+    fprintf(out, "  \"connections\": {\"accepted\": %llu, \"open\": %llu},\n", accepted, accepted - closed);
+
+    unsigned long long subscribed = LOAD(stats.subscribed), unsubscribed = LOAD(stats.unsubscribed);
+    fprintf(out, "  \"subscribers\": {\"active\": %llu, \"pushes\": %llu, \"skipped\": %llu},\n",
+            subscribed - unsubscribed, LOAD(stats.pushes), LOAD(stats.push_skipped));
+    fprintf(out, "  \"sync_mode\": \"%s\",\n", sync_mode_names[sync_mode]);
+
+    fprintf(out, "  \"latency_ns\": {\n");
+    write_histogram_json(out, "parse", &stats.parse, false);
+    write_histogram_json(out, "warehouse", &stats.warehouse, false);
+    write_histogram_json(out, "reply", &stats.reply, false);
+    write_histogram_json(out, "loop", &stats.loop, false);
+    write_histogram_json(out, "sync", &stats.sync, true);
+    fprintf(out, "  }\n}\n");
+}
+
+#undef LOAD
+
+// Stats listener thread: every connection gets one report and is closed. A client that sends
+// "JSON" first gets JSON, anything else (including sending nothing) gets the text format.
+void *stats_main(void *arg)
+{
+    while (atomic_load(&running))
+    {
+        int client_fd = accept(stats_listener, NULL, NULL);
+        if (client_fd < 0)
+        {
+            if (errno != EINTR)
+                perror("accept (stats)");
+            continue;
+        }
+
+        // Don't let a silent client hold up the next one
+        struct timeval wait = { .tv_usec = 200000 };
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+
+        char request[16] = {0};
+        ssize_t bytes = recv(client_fd, request, sizeof(request) - 1, 0);
+        bool json = bytes >= 4 && strncasecmp(request, "JSON", 4) == 0;
+
+        FILE *out = fdopen(client_fd, "w");
+        if (!out)
+        {
+            close(client_fd);
+            continue;
+        }
+
+        if (json)
+            write_stats_json(out);
+        else
+            write_stats_text(out);
+        fclose(out); // Also closes client_fd
+    }
+
+    return NULL;
+}
+
+void print_status() 
+{
+    AtomWarehouse stock;
+
+    read_warehouse(&stock);
+
+    log_msg(LOG_INFO, "Atom Warehouse Status:\nCarbon: %llu\nOxygen: %llu\nHydrogen: %llu",
+            stock.carbon, stock.oxygen, stock.hydrogen);
+}
+
+// Atoms needed to build a single molecule, indexed by molecule id (see protocol.h)
+static const AtomWarehouse molecule_recipes[MOLECULE_COUNT] = {
+    [MOLECULE_WATER] = { .hydrogen = 2, .oxygen = 1 },
+    [MOLECULE_CARBON_DIOXIDE] = { .carbon = 1, .oxygen = 2 },
+    [MOLECULE_ALCOHOL] = { .carbon = 2, .hydrogen = 6, .oxygen = 1 },
+    [MOLECULE_GLUCOSE] = { .carbon = 6, .hydrogen = 12, .oxygen = 6 },
+};
+
+// Molecules needed to make a single drink, indexed by drink id and molecule id
+static const unsigned int drink_recipes[DRINK_COUNT][MOLECULE_COUNT] = {
+    [DRINK_SOFT_DRINK] = { [MOLECULE_WATER] = 1, [MOLECULE_CARBON_DIOXIDE] = 1, [MOLECULE_GLUCOSE] = 1 },
+    [DRINK_VODKA] = { [MOLECULE_WATER] = 1, [MOLECULE_ALCOHOL] = 1, [MOLECULE_GLUCOSE] = 1 },
+    [DRINK_CHAMPAGNE] = { [MOLECULE_WATER] = 1, [MOLECULE_CARBON_DIOXIDE] = 1, [MOLECULE_ALCOHOL] = 1 },
+};
+
+enum { NAME_ATOM, NAME_MOLECULE, NAME_DRINK };
+
+// Every atom, molecule and drink name lands in its own slot of this table, so a lookup
+// is one hash and one strcmp. build_name_index() refuses to start on a collision.
+#define NAME_SLOTS 32
+
+typedef struct
+{
+    const char *name;
+    int kind; // NAME_ATOM, NAME_MOLECULE or NAME_DRINK
+    int id;
+} NameSlot;
+
+static NameSlot name_slots[NAME_SLOTS];
+
+static unsigned int name_hash(const char *name, size_t len)
+{
+    return (len + (unsigned char)name[0] + (unsigned char)name[len - 1]) % NAME_SLOTS;
+}
+
+static void index_names(const char *const *names, int count, int kind)
+{
+    for (int i = 0; i < count; i++)
+    {
+        NameSlot *slot = &name_slots[name_hash(names[i], strlen(names[i]))];
+
+        if (slot->name)
+        {
+            fprintf(stderr, "Name table collision between %s and %s\n", slot->name, names[i]);
+            exit(EXIT_FAILURE);
+        }
+        *slot = (NameSlot){ names[i], kind, i };
+    }
+}
+
+void build_name_index()
+{
+    index_names(atom_names, ATOM_COUNT, NAME_ATOM);
+    index_names(molecule_names, MOLECULE_COUNT, NAME_MOLECULE);
+    index_names(drink_names, DRINK_COUNT, NAME_DRINK);
+}
+
+// Return the id of an atom, molecule or drink name, or -1 if it is not one of that kind
+int find_name(int kind, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0)
+        return -1;
+
+    const NameSlot *slot = &name_slots[name_hash(name, len)];
+    if (!slot->name || slot->kind != kind || strcmp(name, slot->name) != 0)
+        return -1;
+
+    return slot->id;
+}
+
+// Journal (--journal): every ADD and successful DELIVER is appended to <save file>.journal.
+// Records are only ever additions to or debits from the counters, so several processes can
+// append to the same journal in any order: the sums wrap through zero and back when a
+// DELIVER lands before the ADD it used. A flusher thread writes them out and fdatasyncs
+// once per interval (group commit), so a crash loses at most one interval of operations.
+// That can include ADDs whose atoms another process already delivered durably; recovery
+// then finds a counter below zero and clamps it. <save file>.snapshot holds the counters as of the start of a
+// journal generation; a compaction folds the journal into a new snapshot. The save file
+// header records the generation its run started, and the first process to open a file
+// that was not closed cleanly rebuilds the warehouse from snapshot + journal.
+#define JOURNAL_MAGIC 0x314c4e524a524244ULL // "DBRJRNL1"
+#define SNAPSHOT_MAGIC 0x3150414e53524244ULL // "DBRSNAP1"
+#define JOURNAL_BUFFER 65536 // Records buffered per flush, per process
+#define JOURNAL_COMPACT_SIZE (16 << 20) // Compact once the journal grows past this many bytes
+
+enum { JOURNAL_ADD = 1, JOURNAL_DELIVER = 2 };
+#define JOURNAL_CONTINUED 0x80 // Set on every record of a multi-item order but the last
+
+typedef struct
+{
+    uint64_t magic;
+    uint64_t generation; // Bumped by every compaction
+} JournalHeader;
+
+typedef struct
+{
+    uint8_t op;     // JOURNAL_ADD or JOURNAL_DELIVER, possibly with JOURNAL_CONTINUED
+    uint8_t item;   // Atom id or molecule id
+    uint16_t reserved;
+    uint32_t check; // Checksum of the record, so a torn tail is recognized
+    uint64_t amount;
+} JournalRecord;
+
+typedef struct
+{
+    uint64_t magic;
+    uint64_t generation; // The journal generation that starts from these counters
+    uint64_t carbon, oxygen, hydrogen;
+    uint64_t check;
+} Snapshot;
+
+int journal_interval = 0; // fdatasync interval in ms, 0 when journaling is off
+int journal_fd = -1;
+char *journal_path = NULL, *snapshot_path = NULL;
+
+static JournalRecord *journal_buffers[2];
+static int journal_active = 0;  // Buffer appenders fill while the flusher writes the other one
+static size_t journal_count = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_space = PTHREAD_COND_INITIALIZER; // Signalled when the buffers are swapped
+static pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;  // Wakes the flusher early
+static pthread_t journal_thread;
+static bool journal_started = false, journal_stopping = false;
+
+// FNV-1a over the bytes of a record or snapshot, with the check field zeroed
+uint32_t journal_checksum(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+uint32_t record_checksum(JournalRecord rec)
+{
+    rec.check = 0;
+    return journal_checksum(&rec, sizeof(rec));
+}
+
+uint64_t snapshot_checksum(Snapshot snap)
+{
+    snap.check = 0;
+    return journal_checksum(&snap, sizeof(snap));
+}
+
+// Queue records of operations that were just applied to the warehouse. They land in the
+// same buffer, so they reach the journal in a single write.
+void journal_append_records(JournalRecord *recs, int count)
+{
+    if (!journal_interval)
+        return;
+
+    for (int i = 0; i < count; i++)
+        recs[i].check = record_checksum(recs[i]);
+
+    pthread_mutex_lock(&journal_lock);
+
+    // Buffer full: wait for the flusher rather than lose the records
+    while (journal_count + count > JOURNAL_BUFFER)
+    {
+        pthread_cond_signal(&journal_wake);
+        pthread_cond_wait(&journal_space, &journal_lock);
+    }
+
+    size_t before = journal_count;
+    memcpy(&journal_buffers[journal_active][journal_count], recs, count * sizeof(JournalRecord));
+    journal_count += count;
+    if (before < JOURNAL_BUFFER / 2 && journal_count >= JOURNAL_BUFFER / 2)
+        pthread_cond_signal(&journal_wake); // Flush early under heavy load
+
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_append(int op, int item, unsigned long long amount)
+{
+    JournalRecord rec = { .op = op, .item = item, .amount = htole64(amount) };
+    journal_append_records(&rec, 1);
+}
+
+// Apply one journal record to a set of counters
+void apply_record(AtomWarehouse *state, const JournalRecord *rec)
+{
+    unsigned long long amount = le64toh(rec->amount);
+
+    if (rec->op == JOURNAL_ADD)
+    {
+        if (rec->item == ATOM_CARBON)
+            state->carbon += amount;
+        else if (rec->item == ATOM_OXYGEN)
+            state->oxygen += amount;
+        else if (rec->item == ATOM_HYDROGEN)
+            state->hydrogen += amount;
+    }
+    else if (rec->op == JOURNAL_DELIVER && rec->item < MOLECULE_COUNT)
+    {
+        const AtomWarehouse *recipe = &molecule_recipes[rec->item];
+        state->carbon -= recipe->carbon * amount;
+        state->oxygen -= recipe->oxygen * amount;
+        state->hydrogen -= recipe->hydrogen * amount;
+    }
+}
+
+// Rebuild the counters from the snapshot and the journal written since.
+// Returns false if there is no valid snapshot to start from.
+bool replay_journal(int journal, AtomWarehouse *state, uint64_t *generation)
+{
+    Snapshot snap;
+    int snap_fd = open(snapshot_path, O_RDONLY);
+
+    if (snap_fd < 0)
+        return false;
+
+    bool valid = read(snap_fd, &snap, sizeof(snap)) == sizeof(snap) &&
+                 snap.magic == SNAPSHOT_MAGIC && snap.check == snapshot_checksum(snap);
+    close(snap_fd);
+
+    if (!valid)
+        return false;
+
+    *state = (AtomWarehouse){ snap.carbon, snap.oxygen, snap.hydrogen };
+    *generation = snap.generation;
+
+    // A journal of an older generation was already folded into the snapshot
+    JournalHeader header;
+    if (pread(journal, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != JOURNAL_MAGIC || header.generation != snap.generation)
+        return true;
+
+    JournalRecord recs[1024];
+    JournalRecord order[MAX_ORDER_ITEMS]; // Records of an order whose last record was not seen yet
+    int pending = 0;
+    off_t offset = sizeof(header);
+    ssize_t bytes;
+
+    while ((bytes = pread(journal, recs, sizeof(recs), offset)) > 0)
+    {
+        size_t count = bytes / sizeof(JournalRecord);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            // Torn tail of a crashed write, nothing valid follows. An order cut short is dropped whole.
+            if (recs[i].check != record_checksum(recs[i]) || pending == MAX_ORDER_ITEMS)
+                return true;
+
+            order[pending] = recs[i];
+            order[pending].op &= ~JOURNAL_CONTINUED;
+            pending++;
+
+            if (recs[i].op & JOURNAL_CONTINUED)
+                continue;
+
+            for (int j = 0; j < pending; j++)
+                apply_record(state, &order[j]);
+            pending = 0;
+        }
+
+        if (count == 0)
+            break; // Partial record at the end
+        offset += count * sizeof(JournalRecord);
+    }
+
+    return true;
+}
+
+// fsync the directory holding path, so a rename into it is durable
+void sync_parent_dir(const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+
+    int dir_fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(copy);
+}
+
+// Make state the snapshot of generation and start an empty journal for it.
+// The snapshot is renamed into place before the old journal is dropped, so a crash in
+// between leaves a journal whose generation the snapshot already covers.
+int journal_checkpoint(const AtomWarehouse *state, uint64_t generation)
+{
+    Snapshot snap = {
+        .magic = SNAPSHOT_MAGIC,
+        .generation = generation,
+        .carbon = state->carbon,
+        .oxygen = state->oxygen,
+        .hydrogen = state->hydrogen
+    };
+    snap.check = snapshot_checksum(snap);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snapshot_path);
+
+    int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (tmp_fd < 0 || write(tmp_fd, &snap, sizeof(snap)) != sizeof(snap) || fsync(tmp_fd) < 0)
+    {
+        perror("snapshot");
+        if (tmp_fd >= 0)
+            close(tmp_fd);
+        return -1;
+    }
+    close(tmp_fd);
+
+    if (rename(tmp_path, snapshot_path) < 0)
+    {
+        perror("rename (snapshot)");
+        return -1;
+    }
+    sync_parent_dir(snapshot_path);
+
+    JournalHeader header = { .magic = JOURNAL_MAGIC, .generation = generation };
+    if (ftruncate(journal_fd, 0) < 0 || write(journal_fd, &header, sizeof(header)) != sizeof(header) ||
+        fdatasync(journal_fd) < 0)
+    {
+        perror("journal");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Fold the journal into a new snapshot. Other processes may be appending, so their
+// flushers are held off with an exclusive lock on the journal.
+void journal_compact()
+{
+    AtomWarehouse state;
+    uint64_t generation;
+
+    flock(journal_fd, LOCK_EX);
+    if (replay_journal(journal_fd, &state, &generation))
+        journal_checkpoint(&state, generation + 1);
+    flock(journal_fd, LOCK_UN);
+}
+
+// Write out whatever has been appended so far and make it durable
+void journal_flush()
+{
+    pthread_mutex_lock(&journal_lock);
+    JournalRecord *records = journal_buffers[journal_active];
+    size_t count = journal_count;
+    journal_active ^= 1;
+    journal_count = 0;
+    pthread_cond_broadcast(&journal_space);
+    pthread_mutex_unlock(&journal_lock);
+
+    if (count == 0)
+        return;
+
+    // Shared lock: appending never conflicts with other processes, only with a compaction
+    flock(journal_fd, LOCK_SH);
+
+    const char *data = (const char *)records;
+    size_t left = count * sizeof(JournalRecord);
+    while (left > 0)
+    {
+        ssize_t written = write(journal_fd, data, left);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_msg(LOG_ERROR, "journal write: %s", strerror(errno));
+            break;
+        }
+        data += written;
+        left -= written;
+    }
+
+    if (fdatasync(journal_fd) < 0)
+        log_msg(LOG_ERROR, "journal fdatasync: %s", strerror(errno));
+
+    off_t size = lseek(journal_fd, 0, SEEK_END);
+    flock(journal_fd, LOCK_UN);
+
+    if (size > JOURNAL_COMPACT_SIZE)
+        journal_compact();
+}
+
+void *journal_main(void *arg)
+{
+    pthread_mutex_lock(&journal_lock);
+    while (!journal_stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)journal_interval * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        pthread_cond_timedwait(&journal_wake, &journal_lock, &deadline);
+
+        pthread_mutex_unlock(&journal_lock);
+        journal_flush();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    journal_flush(); // Whatever was appended before the stop request
+    return NULL;
+}
+
+// Name the journal files after the save file
+void journal_paths()
+{
+    journal_path = malloc(strlen(save_file_path) + sizeof(".journal"));
+    snapshot_path = malloc(strlen(save_file_path) + sizeof(".snapshot"));
+    if (!journal_path || !snapshot_path)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(journal_path, "%s.journal", save_file_path);
+    sprintf(snapshot_path, "%s.snapshot", save_file_path);
+}
+
+// Rebuild the warehouse from the snapshot and journal of the last journaled run of the
+// save file. A snapshot older than the generation recorded in the header was left behind
+// by an earlier run, and the mapping holds newer counters than it does.
+// Returns false if there is nothing to recover from.
+bool journal_recover(uint64_t *generation)
+{
+    uint64_t since = warehouse->header.journal_generation;
+    AtomWarehouse state;
+
+    if (since == 0)
+        return false; // The file was last opened without --journal
+
+    int fd = open(journal_path, O_RDONLY);
+    bool valid = replay_journal(fd, &state, generation);
+    if (fd >= 0)
+        close(fd);
+
+    if (!valid || *generation < since)
+    {
+        if (valid)
+            printf("Ignoring %s, it is older than %s\n", snapshot_path, save_file_path);
+        *generation = 0;
+        return false;
+    }
+
+    // A process crashed with ADDs unflushed that deliveries of other processes had used
+    unsigned long long *counters[ATOM_COUNT] = { &state.carbon, &state.oxygen, &state.hydrogen };
+    for (int i = 0; i < ATOM_COUNT; i++)
+    {
+        if (*counters[i] > LLONG_MAX)
+        {
+            fprintf(stderr, "Journal %s is missing ADDs of %llu %s that were delivered, clamping %s to 0\n",
+                    journal_path, -*counters[i], atom_names[i], atom_names[i]);
+            *counters[i] = 0;
+        }
+    }
+
+    atomic_store(&warehouse->carbon, state.carbon);
+    atomic_store(&warehouse->oxygen, state.oxygen);
+    atomic_store(&warehouse->hydrogen, state.hydrogen);
+    printf("Recovered warehouse from %s\n", journal_path);
+    return true;
+}
+
+// Open the journal next to the save file. The first process (alone) also starts a fresh
+// generation after the given one, from the counters as they are now.
+void journal_open(bool alone, uint64_t generation)
+{
+    journal_buffers[0] = malloc(JOURNAL_BUFFER * sizeof(JournalRecord));
+    journal_buffers[1] = malloc(JOURNAL_BUFFER * sizeof(JournalRecord));
+    if (!journal_buffers[0] || !journal_buffers[1])
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    journal_fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (journal_fd < 0)
+    {
+        perror("open (journal)");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!alone)
+        return;
+
+    AtomWarehouse state;
+    read_warehouse(&state);
+
+    if (journal_checkpoint(&state, generation + 1) < 0)
+        exit(EXIT_FAILURE);
+    warehouse->header.journal_generation = generation + 1;
+}
+
+// Running without --journal: the snapshot and journal would fall behind the save file,
+// so they must not be replayed over it later
+void journal_discard()
+{
+    if (unlink(snapshot_path) < 0 && errno != ENOENT)
+        perror("unlink (snapshot)");
+    if (unlink(journal_path) < 0 && errno != ENOENT)
+        perror("unlink (journal)");
+    warehouse->header.journal_generation = 0;
+}
+
+void journal_start()
+{
+    if (pthread_create(&journal_thread, NULL, journal_main, NULL) != 0)
+    {
+        perror("pthread_create (journal)");
+        exit(EXIT_FAILURE);
+    }
+    journal_started = true;
+}
+
+void journal_stop()
+{
+    if (!journal_started)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    journal_stopping = true;
+    pthread_cond_signal(&journal_wake);
+    pthread_mutex_unlock(&journal_lock);
+
+    pthread_join(journal_thread, NULL);
+    journal_started = false;
+}
+
+static _Atomic unsigned long long sync_changes; // Operations since the last msync
+
+// Flush the mapped warehouse to the save file
+void sync_warehouse()
+{
+    unsigned long long start = stats_now();
+
+    atomic_store_explicit(&sync_changes, 0, memory_order_relaxed);
+    if (msync(warehouse, sizeof(SharedWarehouse), MS_SYNC) < 0)
+        log_msg(LOG_ERROR, "msync: %s", strerror(errno));
+
+    stats_lap(&stats.sync, start);
+}
+
+long futex(_Atomic uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+    // Not FUTEX_PRIVATE_FLAG: the word may live in a mapping shared with other processes
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Tell the watchers of all processes that the counters changed. Only the first change after
+// a watcher went to sleep costs a wake-up syscall.
+void ring_doorbell()
+{
+    atomic_fetch_add(&warehouse->changes, 1);
+    atomic_fetch_add(&warehouse->doorbell, 1);
+
+    if (atomic_load_explicit(&warehouse->doorbell_armed, memory_order_relaxed) &&
+        atomic_exchange(&warehouse->doorbell_armed, 0))
+        futex(&warehouse->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// Print the warehouse whenever it changed, in this process or another one sharing the save file.
+// Sleeps on the doorbell, so updates are reported immediately and an idle warehouse costs nothing.
+void *watcher_main(void *arg)
+{
+    uint32_t reported = atomic_load(&warehouse->doorbell);
+    struct timespec wait = { .tv_sec = 1 }; // Bounded so shutdown is noticed
+
+    while (atomic_load(&running))
+    {
+        atomic_store(&warehouse->doorbell_armed, 1);
+
+        // Re-check after arming: a change in between would not have woken us
+        if (atomic_load(&warehouse->doorbell) == reported)
+            futex(&warehouse->doorbell, FUTEX_WAIT, reported, &wait);
+
+        uint32_t current = atomic_load(&warehouse->doorbell);
+        if (current != reported)
+        {
+            reported = current;
+            log_msg(LOG_INFO, "[Update detected] Warehouse changed");
+            print_status();
+        }
+    }
+    return NULL;
+}
+
+static pthread_t watcher_thread;
+static bool watcher_started = false;
+
+void watcher_start()
+{
+    if (pthread_create(&watcher_thread, NULL, watcher_main, NULL) != 0)
+    {
+        perror("pthread_create (watcher)");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    watcher_started = true;
+}
+
+// Wake the watcher from the doorbell futex and wait for it to see that running was cleared
+void watcher_stop()
+{
+    if (!watcher_started)
+        return;
+
+    atomic_store(&running, 0);
+    futex(&warehouse->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+    pthread_join(watcher_thread, NULL);
+    watcher_started = false;
+}
+
+// Called after every ADD or DELIVER that changed the counters
+void warehouse_changed()
+{
+    ring_doorbell();
+
+    if (sync_mode == SYNC_NONE)
+        return;
+
+    unsigned long long changes = atomic_fetch_add_explicit(&sync_changes, 1, memory_order_relaxed) + 1;
+
+    if (sync_mode == SYNC_EVERY || (sync_mode == SYNC_BATCH && changes >= (unsigned long long)sync_arg))
+        sync_warehouse();
+}
+
+static pthread_t sync_thread;
+static bool sync_started = false, sync_stopping = false;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_wake = PTHREAD_COND_INITIALIZER; // Signalled to stop early
+
+void *sync_main(void *arg)
+{
+    pthread_mutex_lock(&sync_lock);
+    while (!sync_stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)sync_arg * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        if (pthread_cond_timedwait(&sync_wake, &sync_lock, &deadline) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&sync_lock);
+        if (atomic_load_explicit(&sync_changes, memory_order_relaxed))
+            sync_warehouse(); // Nothing to do while idle
+        pthread_mutex_lock(&sync_lock);
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
+
+void sync_start()
+{
+    if (pthread_create(&sync_thread, NULL, sync_main, NULL) != 0)
+    {
+        perror("pthread_create (sync)");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    sync_started = true;
+}
+
+void sync_stop()
+{
+    if (!sync_started)
+        return;
+
+    pthread_mutex_lock(&sync_lock);
+    sync_stopping = true;
+    pthread_cond_signal(&sync_wake);
+    pthread_mutex_unlock(&sync_lock);
+
+    pthread_join(sync_thread, NULL);
+    sync_started = false;
+}
+
+// One atom type of a batched ADD
+typedef struct
+{
+    int atom; // Atom id, -1 if unknown
+    unsigned long long amount;
+} AddItem;
+
+// Adding is a single atomic increment per atom, which is safe against concurrent deliveries
+// (they only need a lower bound) and against other processes sharing the mapping.
+// A batch is validated as a whole and costs one journal append and one change notification.
+int add_atom_batch(const AddItem *items, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (items[i].atom < 0 || items[i].atom >= ATOM_COUNT)
+        {
+            stat_inc(&stats.add_unknown);
+            return 1; // Unknown atom type
+        }
+    }
+
+    unsigned long long start = stats_now();
+    JournalRecord recs[MAX_ADD_ITEMS];
+
+    for (int i = 0; i < count; i++)
+    {
+        switch (items[i].atom)
+        {
+        case ATOM_CARBON:
+            atomic_fetch_add_explicit(&warehouse->carbon, items[i].amount, memory_order_relaxed);
+            break;
+        case ATOM_OXYGEN:
+            atomic_fetch_add_explicit(&warehouse->oxygen, items[i].amount, memory_order_relaxed);
+            break;
+        case ATOM_HYDROGEN:
+            atomic_fetch_add_explicit(&warehouse->hydrogen, items[i].amount, memory_order_relaxed);
+            break;
+        }
+
+        stat_inc(&stats.adds[items[i].atom]);
+        recs[i] = (JournalRecord){
+            .op = JOURNAL_ADD | (i < count - 1 ? JOURNAL_CONTINUED : 0),
+            .item = items[i].atom,
+            .amount = htole64(items[i].amount)
+        };
+    }
+
+    stats_lap(&stats.warehouse, start);
+    journal_append_records(recs, count);
+    warehouse_changed();
+    return 0; // Successfully added atoms
+}
+
+int add_atom(int atom, unsigned long long amount)
+{
+    AddItem item = { .atom = atom, .amount = amount };
+    return add_atom_batch(&item, 1);
+}
+
+int add_atoms(const char *atom, unsigned long long amount)
+{
+    return add_atom(find_name(NAME_ATOM, atom), amount);
+}
+
+// One line of a DELIVER order
+typedef struct
+{
+    int molecule; // Molecule id, -1 if unknown
+    unsigned long long amount;
+} OrderItem;
+
+// "3 WATER, 2 GLUCOSE", for log messages
+void describe_order(const OrderItem *items, int count, char *out, size_t size)
+{
+    size_t len = 0;
+    out[0] = '\0';
+
+    for (int i = 0; i < count && len < size; i++)
+    {
+        const char *name = (items[i].molecule >= 0 && items[i].molecule < MOLECULE_COUNT) ? molecule_names[items[i].molecule] : "?";
+        len += snprintf(out + len, size - len, "%s%llu %s", i ? ", " : "", items[i].amount, name);
+    }
+}
+
+// Fill in the number of atoms of each type needed to build a single molecule
+int get_molecule_recipe(const char *molecule, AtomWarehouse *recipe)
+{
+    int id = find_name(NAME_MOLECULE, molecule);
+
+    if (id == -1)
+        return -1; // Unknown molecule type
+
+    *recipe = molecule_recipes[id];
+    return 0;
+}
+
+// Closed-form capacity: the maximum number of molecules is the smallest
+// stock / requirement quotient over the atoms the recipe actually uses
+unsigned long long max_molecules(const AtomWarehouse *stock, const AtomWarehouse *recipe)
+{
+    unsigned long long res = ULLONG_MAX;
+
+    if (recipe->carbon && stock->carbon / recipe->carbon < res)
+        res = stock->carbon / recipe->carbon;
+    if (recipe->oxygen && stock->oxygen / recipe->oxygen < res)
+        res = stock->oxygen / recipe->oxygen;
+    if (recipe->hydrogen && stock->hydrogen / recipe->hydrogen < res)
+        res = stock->hydrogen / recipe->hydrogen;
+
+    return res;
+}
+
+int get_amount_of_molecules(const AtomWarehouse *stock, const char *molecule, unsigned long long *amount)
+{
+    AtomWarehouse recipe;
+
+    if (get_molecule_recipe(molecule, &recipe) == -1)
+        return -1; // Unknown molecule type
+
+    *amount = max_molecules(stock, &recipe); // Maximum number of molecules that can be created
+    return 0;
+}
+
+// Deliver every item of an order or none of them. The whole order is checked and debited
+// inside a single critical section, so a concurrent delivery can never leave it half filled.
+int deliver_order(const OrderItem *items, int count)
+{
+    AtomWarehouse need = {0};
+    bool too_much = false; // More atoms than a counter can hold, so certainly not enough
+
+    for (int i = 0; i < count; i++)
+    {
+        if (items[i].molecule < 0 || items[i].molecule >= MOLECULE_COUNT)
+        {
+            stat_inc(&stats.deliver_unknown);
+            return 1; // Unknown molecule type
+        }
+
+        const AtomWarehouse *recipe = &molecule_recipes[items[i].molecule];
+        unsigned long long carbon, oxygen, hydrogen;
+        too_much |= __builtin_mul_overflow(recipe->carbon, items[i].amount, &carbon) ||
+                    __builtin_mul_overflow(recipe->oxygen, items[i].amount, &oxygen) ||
+                    __builtin_mul_overflow(recipe->hydrogen, items[i].amount, &hydrogen) ||
+                    __builtin_add_overflow(need.carbon, carbon, &need.carbon) ||
+                    __builtin_add_overflow(need.oxygen, oxygen, &need.oxygen) ||
+                    __builtin_add_overflow(need.hydrogen, hydrogen, &need.hydrogen);
+    }
+
+    unsigned long long start = stats_now();
+
+    unsigned long long seq = begin_delivery(); // Excludes deliveries of all threads and processes
+
+    // Concurrent ADDs only increase the counters, so this is a safe lower bound
+    AtomWarehouse stock = {
+        .carbon = atomic_load_explicit(&warehouse->carbon, memory_order_relaxed),
+        .oxygen = atomic_load_explicit(&warehouse->oxygen, memory_order_relaxed),
+        .hydrogen = atomic_load_explicit(&warehouse->hydrogen, memory_order_relaxed)
+    };
+
+    // Not enough atoms to create the requested amounts of molecules
+    if (too_much || stock.carbon < need.carbon || stock.oxygen < need.oxygen || stock.hydrogen < need.hydrogen)
+    {
+        end_delivery(seq, false);
+        stats_lap(&stats.warehouse, start);
+        for (int i = 0; i < count; i++)
+            stat_inc(&stats.not_enough[items[i].molecule]);
+        return -1;
+    }
+
+    atomic_fetch_sub_explicit(&warehouse->carbon, need.carbon, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&warehouse->oxygen, need.oxygen, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&warehouse->hydrogen, need.hydrogen, memory_order_relaxed);
+
+    end_delivery(seq, true);
+    stats_lap(&stats.warehouse, start);
+
+    JournalRecord recs[MAX_ORDER_ITEMS];
+    for (int i = 0; i < count; i++)
+    {
+        stat_inc(&stats.delivered[items[i].molecule]);
+        recs[i] = (JournalRecord){
+            .op = JOURNAL_DELIVER | (i < count - 1 ? JOURNAL_CONTINUED : 0),
+            .item = items[i].molecule,
+            .amount = htole64(items[i].amount)
+        };
+    }
+    journal_append_records(recs, count);
+    warehouse_changed();
+
+    return 0; // Successfully delivered the order
+}
+
+int deliver_molecule(int molecule, unsigned long long amount)
+{
+    OrderItem item = { .molecule = molecule, .amount = amount };
+    return deliver_order(&item, 1);
+}
+
+int deliver_molecules(const char *molecule, unsigned long long amount)
+{
+    return deliver_molecule(find_name(NAME_MOLECULE, molecule), amount);
+}
+
+// Drink capacities as of one change count. Every ADD and DELIVER of any process bumps it with
+// the doorbell after changing the counters, so an unchanged count means the view is current and
+// a GEN is a load and an array read. The 32-bit doorbell itself would match again after 2^32 changes. Each thread keeps its own view, so nothing is shared.
+typedef struct
+{
+    bool valid;
+    uint64_t changes;
+    unsigned long long amounts[DRINK_COUNT];
+} DrinkView;
+
+static __thread DrinkView drink_view;
+
+// How many of every drink the stock is enough for. Each molecule is counted against
+// the whole stock, a drink is limited by the scarcest one.
+void drink_capacities(const AtomWarehouse *stock, unsigned long long amounts[DRINK_COUNT])
+{
+    for (int d = 0; d < DRINK_COUNT; d++)
+    {
+        unsigned long long res = ULLONG_MAX;
+        for (int m = 0; m < MOLECULE_COUNT; m++)
+        {
+            if (!drink_recipes[d][m])
+                continue;
+
+            unsigned long long molecules = max_molecules(stock, &molecule_recipes[m]) / drink_recipes[d][m];
+            if (molecules < res)
+                res = molecules;
+        }
+        amounts[d] = res;
+    }
+}
+
+int get_drink_capacity(int id, unsigned long long *amount)
+{
+    if (id < 0 || id >= DRINK_COUNT)
+        return -1; // Unknown drink type
+
+    // Read before the snapshot: a change racing with it leaves the view stale by one ring
+    uint64_t changes = atomic_load(&warehouse->changes);
+
+    if (!drink_view.valid || drink_view.changes != changes)
+    {
+        AtomWarehouse stock;
+        read_warehouse(&stock); // All drinks are computed from the same snapshot
+        drink_capacities(&stock, drink_view.amounts);
+
+        drink_view.changes = changes;
+        drink_view.valid = true;
+    }
+
+    *amount = drink_view.amounts[id];
+    return 0;
+}
+
+int get_amount_to_gen(const char *drink, unsigned long long *amount)
+{
+    return get_drink_capacity(find_name(NAME_DRINK, drink), amount);
+}
+
+// Answer "GEN <DRINK> [#id]" from a network client with the number of drinks that can be made,
+// or an error, into reply. Display boards poll this, so it only logs at debug level.
+int handle_gen_request(const char *text, const char *transport, char *reply, size_t reply_size)
+{
+    char drink[32];
+    unsigned long long amount, request_id;
+
+    // The drink name runs up to the tag or the end of the line
+    text += strspn(text, " ");
+    size_t len = strcspn(text, "#\r\n");
+    bool tagged = text[len] == '#' && sscanf(text + len, "#%llu", &request_id) == 1;
+
+    while (len > 0 && text[len - 1] == ' ')
+        len--;
+    if (len >= sizeof(drink))
+        len = sizeof(drink) - 1;
+    memcpy(drink, text, len);
+    drink[len] = '\0';
+
+    stat_inc(&stats.gen_requests);
+
+    int n;
+    if (len == 0)
+    {
+        log_msg(LOG_WARN, "%s: Missing drink name", transport);
+        n = snprintf(reply, reply_size, "ERROR: Missing drink name");
+    }
+    else if (get_amount_to_gen(drink, &amount) == -1)
+    {
+        log_msg(LOG_WARN, "%s: Unknown drink type: %s", transport, drink);
+        n = snprintf(reply, reply_size, "ERROR: Unknown drink type");
+    }
+    else
+    {
+        log_msg(LOG_DEBUG, "%s: %llu %s can be generated", transport, amount, drink);
+        n = snprintf(reply, reply_size, "%llu", amount);
+    }
+
+    if (tagged)
+        n += snprintf(reply + n, reply_size - n, " #%llu", request_id);
+    n += snprintf(reply + n, reply_size - n, "\n");
+    return n;
+}
+
+// Binary GEN: the reply carries the drink capacity in its amount field
+int handle_binary_gen(const BinaryFrame *frame, const char *transport, char *reply)
+{
+    BinaryFrame answer = { .magic = BINARY_MAGIC, .opcode = OP_REPLY, .request_id = frame->request_id };
+    unsigned long long amount = 0;
+
+    stat_inc(&stats.gen_requests);
+    if (get_drink_capacity(frame->item, &amount) == -1)
+    {
+        log_msg(LOG_WARN, "%s: Unknown drink id: %d", transport, frame->item);
+        answer.item = STATUS_UNKNOWN_DRINK;
+    }
+    else
+    {
+        log_msg(LOG_DEBUG, "%s: %llu %s can be generated", transport, amount, drink_names[frame->item]);
+        answer.item = STATUS_DELIVERED;
+        answer.amount = htole64(amount);
+    }
+
+    memcpy(reply, &answer, sizeof(answer));
+    return sizeof(answer);
+}
+
+StreamBuffer *new_stream_buffer(int fd)
+{
+    StreamBuffer *in = calloc(1, sizeof(StreamBuffer));
+    if (!in)
+    {
+        perror("calloc");
+        return NULL;
+    }
+
+    in->fd = fd;
+    return in;
+}
+
+bool stream_output_pending(const StreamBuffer *in)
+{
+    return in->out_len > in->out_head;
+}
+
+// Backpressure: a client with this much unsent output is not read until it catches up
+bool stream_output_full(const StreamBuffer *in)
+{
+    return in->out_len - in->out_head >= high_water;
+}
+
+// Send queued output until the socket would block. Returns -1 if the connection is broken.
+int flush_stream_output(StreamBuffer *in)
+{
+    while (stream_output_pending(in))
+    {
+        ssize_t sent = send(in->fd, in->out + in->out_head, in->out_len - in->out_head, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            log_msg(LOG_WARN, "TCP / UDS stream: send: %s", strerror(errno));
+            in->out_head = in->out_len = 0;
+            return -1;
+        }
+        in->out_head += sent;
+    }
+
+    in->out_head = in->out_len = 0;
+    return 0;
+}
+
+// Send a reply to a stream client without ever blocking the event loop. Whatever the socket
+// does not take is queued behind earlier output and sent when the loop sees it writable.
+void send_stream_reply(StreamBuffer *in, const char *reply, size_t len)
+{
+    if (!stream_output_pending(in))
+    {
+        ssize_t sent = send(in->fd, reply, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            log_msg(LOG_WARN, "TCP / UDS stream: send: %s", strerror(errno));
+            return; // Broken connection, the next read closes it
+        }
+        if (sent > 0)
+        {
+            reply += sent;
+            len -= sent;
+        }
+        if (len == 0)
+            return;
+    }
+
+    if (in->out_size - in->out_len < len)
+    {
+        // Reuse the space of what was sent already, grow if that is not enough
+        memmove(in->out, in->out + in->out_head, in->out_len - in->out_head);
+        in->out_len -= in->out_head;
+        in->out_head = 0;
+
+        if (in->out_size - in->out_len < len)
+        {
+            size_t size = in->out_size ? in->out_size : BUFFER_SIZE;
+            while (size - in->out_len < len)
+                size *= 2;
+
+            char *out = realloc(in->out, size);
+            if (!out)
+            {
+                log_msg(LOG_ERROR, "TCP / UDS stream: Out of memory, dropping a %zu byte reply", len);
+                return;
+            }
+            in->out = out;
+            in->out_size = size;
+        }
+    }
+
+    memcpy(in->out + in->out_len, reply, len);
+    in->out_len += len;
+}
+
+#define MAX_SUBSCRIBERS 256      // Inventory subscribers per process
+#define SUBSCRIBE_DEFAULT_MS 100 // Minimum time between two pushes to one subscriber, unless it asks otherwise
+#define SUBSCRIBE_MIN_MS 10      // Shorter intervals are raised to this
+#define SUBSCRIBE_MAX_MS 3600000 // Longer ones are lowered to this
+
+// A stream client that sent SUBSCRIBE. The publisher thread decides when it is due a push and
+// wakes the loop serving it, which sends the line like any other reply. Changes are coalesced:
+// however many happen within one interval, the subscriber gets one line.
+typedef struct
+{
+    StreamBuffer *in;
+    int wake_fd;                  // Wake-up eventfd of the loop serving the connection
+    unsigned long long interval;  // Minimum ns between two pushes
+    unsigned long long next_push; // Monotonic ns before which nothing is pushed
+    uint32_t doorbell;            // Doorbell value of the last state pushed
+} Subscriber;
+
+static Subscriber subscribers[MAX_SUBSCRIBERS];
+static _Atomic int subscriber_count; // Changed under subscribers_lock, read without it to skip the lock
+static pthread_mutex_t subscribers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Format the atoms and the drinks they make as one line, from a single snapshot
+int format_inventory(char *out, size_t size)
+{
+    AtomWarehouse stock;
+    unsigned long long drinks[DRINK_COUNT];
+
+    read_warehouse(&stock);
+    drink_capacities(&stock, drinks);
+
+    int n = snprintf(out, size, "INVENTORY %s %llu, %s %llu, %s %llu", atom_names[ATOM_CARBON], stock.carbon,
+                     atom_names[ATOM_OXYGEN], stock.oxygen, atom_names[ATOM_HYDROGEN], stock.hydrogen);
+    for (int d = 0; d < DRINK_COUNT; d++)
+        n += snprintf(out + n, size - n, ", %s %llu", drink_names[d], drinks[d]);
+    n += snprintf(out + n, size - n, "\n");
+    return n;
+}
+
+// Caller holds subscribers_lock
+Subscriber *find_subscriber(const StreamBuffer *in)
+{
+    for (int i = 0; i < subscriber_count; i++)
+        if (subscribers[i].in == in)
+            return &subscribers[i];
+    return NULL;
+}
+
+// Send the push the publisher asked for. A client that is behind on reading keeps it due:
+// it is sent, with the state of that moment, once the client drained its queue.
+void deliver_push(StreamBuffer *in)
+{
+    char line[BUFFER_SIZE];
+
+    if (!atomic_load_explicit(&in->push_due, memory_order_relaxed) || stream_output_full(in))
+        return;
+
+    atomic_store(&in->push_due, false);
+    send_stream_reply(in, line, format_inventory(line, sizeof(line)));
+    stat_inc(&stats.pushes);
+}
+
+// "SUBSCRIBE [interval_ms]": send the inventory now, and again after changes, at most once per interval.
+// Subscribing again only changes the interval.
+void handle_subscribe(const char *args, StreamBuffer *in)
+{
+    char line[BUFFER_SIZE], extra;
+    long interval_ms = SUBSCRIBE_DEFAULT_MS;
+    int fields = sscanf(args, "%ld %c", &interval_ms, &extra);
+
+    if (fields == 0 || fields == 2)
+    {
+        log_msg(LOG_WARN, "TCP / UDS stream: Invalid SUBSCRIBE interval: %s", args);
+        static const char error[] = "ERROR: Invalid interval\n";
+        send_stream_reply(in, error, sizeof(error) - 1);
+        return;
+    }
+    if (interval_ms < SUBSCRIBE_MIN_MS)
+        interval_ms = SUBSCRIBE_MIN_MS;
+    if (interval_ms > SUBSCRIBE_MAX_MS)
+        interval_ms = SUBSCRIBE_MAX_MS;
+
+    pthread_mutex_lock(&subscribers_lock);
+    Subscriber *s = find_subscriber(in);
+    if (!s)
+    {
+        if (subscriber_count == MAX_SUBSCRIBERS)
+        {
+            pthread_mutex_unlock(&subscribers_lock);
+            log_msg(LOG_WARN, "TCP / UDS stream: Too many subscribers");
+            static const char error[] = "ERROR: Too many subscribers\n";
+            send_stream_reply(in, error, sizeof(error) - 1);
+            return;
+        }
+
+        s = &subscribers[subscriber_count];
+        *s = (Subscriber){ .in = in, .wake_fd = wake_fd };
+        atomic_store(&subscriber_count, subscriber_count + 1);
+        stat_inc(&stats.subscribed);
+    }
+
+    s->doorbell = atomic_load(&warehouse->doorbell); // Before the snapshot, like the drink view
+    s->interval = interval_ms * 1000000ULL;
+    s->next_push = monotonic_ns() + s->interval;
+    pthread_mutex_unlock(&subscribers_lock);
+
+    send_stream_reply(in, line, format_inventory(line, sizeof(line)));
+
+    // The publisher may be asleep without watching the doorbell; have it look at the new subscriber
+    futex(&warehouse->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+
+    log_msg(LOG_INFO, "TCP / UDS stream: Subscribed, pushes at most every %ld ms", interval_ms);
+}
+
+// Forget the subscription of a connection, if it has one. Must be called before its buffers are freed.
+void unsubscribe(StreamBuffer *in)
+{
+    if (atomic_load_explicit(&subscriber_count, memory_order_relaxed) == 0)
+        return;
+
+    pthread_mutex_lock(&subscribers_lock);
+    Subscriber *s = find_subscriber(in);
+    if (s)
+    {
+        int last = subscriber_count - 1;
+        if (s != &subscribers[last])
+            *s = subscribers[last];
+        atomic_store(&subscriber_count, last);
+        stat_inc(&stats.unsubscribed);
+    }
+    pthread_mutex_unlock(&subscribers_lock);
+}
+
+void free_stream_buffer(StreamBuffer *in)
+{
+    if (!in)
+        return;
+
+    unsubscribe(in);
+    free(in->out);
+    free(in);
+}
+
+// Hand a push to the loop of every subscriber that has not seen the latest change and whose
+// interval has passed. Sleeps on the doorbell only while some subscriber is up to date, otherwise
+// just until the next one is due, so a burst of changes costs one wake-up and one push per
+// subscriber and interval.
+void *publisher_main(void *arg)
+{
+    const uint64_t one = 1;
+
+    while (atomic_load(&running))
+    {
+        uint32_t current = atomic_load(&warehouse->doorbell);
+        unsigned long long now = monotonic_ns();
+        unsigned long long wake = now + 1000000000ULL; // Bounded so shutdown is noticed
+        bool watch = false; // Some subscriber would want the next change
+
+        pthread_mutex_lock(&subscribers_lock);
+        for (int i = 0; i < subscriber_count; i++)
+        {
+            Subscriber *s = &subscribers[i];
+
+            if (s->doorbell != current && s->next_push <= now)
+            {
+                if (!atomic_exchange(&s->in->push_due, true))
+                {
+                    if (write(s->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                        log_msg(LOG_ERROR, "write (wake-up): %s", strerror(errno));
+                }
+                else
+                    stat_inc(&stats.push_skipped); // The last push still waits for the client to read, this one merges into it
+
+                s->doorbell = current;
+                s->next_push = now + s->interval;
+            }
+
+            if (s->doorbell == current)
+                watch = true;
+            else if (s->next_push < wake)
+                wake = s->next_push;
+        }
+        pthread_mutex_unlock(&subscribers_lock);
+
+        if (watch)
+            atomic_store(&warehouse->doorbell_armed, 1);
+
+        // Re-check after arming: a change in between would not have woken us
+        now = monotonic_ns();
+        if (wake > now && atomic_load(&warehouse->doorbell) == current)
+        {
+            struct timespec wait = { .tv_sec = (wake - now) / 1000000000ULL, .tv_nsec = (wake - now) % 1000000000ULL };
+            futex(&warehouse->doorbell, FUTEX_WAIT, current, &wait);
+        }
+    }
+    return NULL;
+}
+
+static pthread_t publisher_thread;
+static bool publisher_started = false;
+
+void publisher_start()
+{
+    if (pthread_create(&publisher_thread, NULL, publisher_main, NULL) != 0)
+    {
+        perror("pthread_create (publisher)");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    publisher_started = true;
+}
+
+void publisher_stop()
+{
+    if (!publisher_started)
+        return;
+
+    atomic_store(&running, 0);
+    futex(&warehouse->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+    pthread_join(publisher_thread, NULL);
+    publisher_started = false;
+}
+
+// Create this loop's wake-up eventfd
+int open_wake_fd()
+{
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+        perror("eventfd");
+    return wake_fd;
+}
+
+// Reset the wake-up eventfd; the loop then delivers every push that is due
+void drain_wake_fd()
+{
+    uint64_t count;
+
+    if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_msg(LOG_ERROR, "read (wake-up): %s", strerror(errno));
+}
+
+// Handle binary DELIVER (or GEN) frames and build the binary reply frame into reply. A datagram
+// carrying several DELIVER frames with the same request id is one order, delivered atomically.
+int handle_binary_request(const char *buffer, int length, const char *transport, char *reply)
+{
+    BinaryFrame frame, answer = { .magic = BINARY_MAGIC, .opcode = OP_REPLY };
+    OrderItem items[MAX_ORDER_ITEMS];
+    int count = length / sizeof(BinaryFrame);
+    bool valid = true;
+
+    memcpy(&frame, buffer, sizeof(frame));
+    if (count == 1 && frame.opcode == OP_GEN)
+        return handle_binary_gen(&frame, transport, reply);
+
+    for (int i = 0; i < count; i++)
+    {
+        BinaryFrame item;
+        memcpy(&item, buffer + i * sizeof(item), sizeof(item));
+
+        if (item.magic != BINARY_MAGIC || item.opcode != OP_DELIVER || item.request_id != frame.request_id)
+        {
+            log_msg(LOG_WARN, "%s: Invalid binary frame %d: opcode %d, request id %u", transport, i, item.opcode, le32toh(item.request_id));
+            valid = false;
+            break;
+        }
+
+        items[i].molecule = (item.item < MOLECULE_COUNT) ? item.item : -1;
+        items[i].amount = le64toh(item.amount);
+    }
+
+    if (!valid)
+    {
+        stat_inc(&stats.deliver_invalid);
+        answer.item = STATUS_INVALID_COMMAND;
+    }
+
+    else
+    {
+        char order[256];
+        describe_order(items, count, order, sizeof(order));
+        int result = deliver_order(items, count);
+
+        if (result == 0)
+        {
+            answer.item = STATUS_DELIVERED;
+            log_msg(LOG_INFO, "%s: Delivered %s molecules", transport, order);
+        }
+
+        else if (result == 1)
+        {
+            answer.item = STATUS_UNKNOWN_MOLECULE;
+            log_msg(LOG_WARN, "%s: Unknown molecule id in: %s", transport, order);
+        }
+
+        else
+        {
+            answer.item = STATUS_NOT_ENOUGH_ATOMS;
+            log_msg(LOG_INFO, "%s: Not enough atoms for %s molecules", transport, order);
+        }
+    }
+
+    answer.request_id = frame.request_id; // Already little-endian, echo as is
+    answer.amount = frame.amount;
+    memcpy(reply, &answer, sizeof(answer));
+    return sizeof(answer);
+}
+
+// Parse the items of "DELIVER <MOLECULE> <amount>[, <MOLECULE> <amount>...]" starting after
+// the command word. Returns the number of items (0 if malformed) and sets *end past the last one.
+// Unknown molecules get id -1 and their name copied to unknown.
+int parse_order(const char *text, OrderItem *items, const char **end, char *unknown, size_t unknown_size)
+{
+    int count = 0;
+
+    while (count < MAX_ORDER_ITEMS)
+    {
+        char molecule[32];
+        unsigned long long amount;
+        int consumed = 0;
+
+        // Used %[^0-9,] to read everything that's not a digit as molecule name
+        if (sscanf(text, " %31[^0-9,] %llu%n", molecule, &amount, &consumed) != 2)
+            return 0;
+        text += consumed;
+
+        // Trim trailing spaces from molecule name
+        int len = strlen(molecule);
+        while (len > 0 && molecule[len - 1] == ' ')
+        {
+            molecule[--len] = '\0';
+        }
+
+        items[count].molecule = find_name(NAME_MOLECULE, molecule);
+        items[count].amount = amount;
+        if (items[count].molecule == -1 && !unknown[0])
+            snprintf(unknown, unknown_size, "%s", molecule);
+        count++;
+
+        while (*text == ' ')
+            text++;
+        if (*text != ',')
+        {
+            *end = text;
+            return count;
+        }
+        text++;
+    }
+
+    return 0; // Too many items
+}
+
+// Handle a DELIVER or GEN request from a datagram client and build the reply into reply.
+// A text request may end with a "#<id>" tag, which is echoed back so clients with several
+// requests in flight can match replies to requests. Binary frames carry their own id.
+int handle_datagram_request(char *buffer, int length, const char *transport, char *reply, size_t reply_size)
+{
+    if (length > 0 && length % sizeof(BinaryFrame) == 0 && length <= MAX_ORDER_ITEMS * (int)sizeof(BinaryFrame) &&
+        (unsigned char)buffer[0] == BINARY_MAGIC)
+        return handle_binary_request(buffer, length, transport, reply);
+
+    unsigned long long start = stats_now();
+
+    // Parse command for DELIVER, with one or more comma separated items
+    char command[16], unknown[32] = "";
+    OrderItem items[MAX_ORDER_ITEMS];
+    unsigned long long request_id;
+    const char *end = buffer;
+    int consumed = 0, count = 0;
+
+    if (sscanf(buffer, "%15s%n", command, &consumed) == 1 && strcmp(command, "GEN") == 0)
+        return handle_gen_request(buffer + consumed, transport, reply, reply_size);
+
+    if (consumed > 0 && strcmp(command, "DELIVER") == 0)
+        count = parse_order(buffer + consumed, items, &end, unknown, sizeof(unknown));
+    bool tagged = (count > 0 && sscanf(end, " #%llu", &request_id) == 1);
+
+    const char *msg;
+
+    // Check if the command is valid
+    if (count == 0)
+    {
+        log_msg(LOG_WARN, "%s: Invalid command: %s", transport, buffer);
+        stat_inc(&stats.deliver_invalid);
+        msg = "ERROR: Invalid command";
+    }
+
+    else
+    {
+        stats_lap(&stats.parse, start);
+
+        // Attempt to deliver the whole order
+        int result = deliver_order(items, count);
+        char order[256];
+
+        if (result != 1)
+            describe_order(items, count, order, sizeof(order));
+
+        if (result == 0)
+        {
+            msg = "DELIVERED";
+            log_msg(LOG_INFO, "%s: Delivered %s molecules", transport, order);
+        }
+
+        else if (result == 1)
+        {
+            msg = "ERROR: Unknown molecule type";
+            log_msg(LOG_WARN, "%s: Unknown molecule type: %s", transport, unknown);
+        }
+
+        else
+        {
+            msg = "NOT ENOUGH ATOMS";
+            log_msg(LOG_INFO, "%s: Not enough atoms for %s molecules", transport, order);
+        }
+    }
+
+    if (tagged)
+        return snprintf(reply, reply_size, "%s #%llu\n", msg, request_id);
+    return snprintf(reply, reply_size, "%s\n", msg);
+}
+
+// Per-thread batch buffers, too large for a worker's stack
+static __thread char dgram_in[DGRAM_BATCH][BUFFER_SIZE];
+static __thread char dgram_out[DGRAM_BATCH][BUFFER_SIZE];
+static __thread struct sockaddr_storage dgram_addrs[DGRAM_BATCH];
+
+// Drain up to DGRAM_BATCH datagrams with one recvmmsg, handle them in order
+// and send every reply back with one sendmmsg.
+// Returns -1 when the socket had nothing to read, 0 otherwise.
+int handle_datagram_batch(int fd, const char *transport)
+{
+    struct mmsghdr in[DGRAM_BATCH], out[DGRAM_BATCH];
+    struct iovec in_iov[DGRAM_BATCH], out_iov[DGRAM_BATCH];
+
+    memset(in, 0, sizeof(in));
+    for (int i = 0; i < DGRAM_BATCH; i++)
+    {
+        in_iov[i].iov_base = dgram_in[i];
+        in_iov[i].iov_len = BUFFER_SIZE - 1; // Leave space for null terminator
+        in[i].msg_hdr.msg_iov = &in_iov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name = &dgram_addrs[i];
+        in[i].msg_hdr.msg_namelen = sizeof(dgram_addrs[i]);
+    }
+
+    // MSG_DONTWAIT: poll already said there is at least one, take whatever else is queued
+    int count = recvmmsg(fd, in, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+
+    if (count < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("recvmmsg");
+        return -1;
+    }
+
+    memset(out, 0, sizeof(out));
+    for (int i = 0; i < count; i++)
+    {
+        int bytes = in[i].msg_len;
+        dgram_in[i][bytes] = '\0'; // Ensure null-termination of the received string
+
+        out_iov[i].iov_base = dgram_out[i];
+        out_iov[i].iov_len = handle_datagram_request(dgram_in[i], bytes, transport, dgram_out[i], BUFFER_SIZE);
+        out[i].msg_hdr.msg_iov = &out_iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+        out[i].msg_hdr.msg_name = &dgram_addrs[i];
+        out[i].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+    }
+
+    unsigned long long start = stats_now();
+
+    // A reply we fail to send is dropped, just like a lost datagram
+    for (int sent = 0; sent < count;)
+    {
+        int n = sendmmsg(fd, out + sent, count - sent, MSG_DONTWAIT);
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("sendmmsg");
+            break;
+        }
+        sent += n;
+    }
+
+    stats_lap(&stats.reply, start);
+    return 0;
+}
+
+int handle_udp_client(int fd)
+{
+    return handle_datagram_batch(fd, "UDP");
+}
+
+int handle_uds_datagram_client(int fd)
+{
+    if (handle_datagram_batch(fd, "UDS datagram") < 0)
+        return -1;
+
+    print_status(); // Print the current status of the warehouse
+    return 0;
+}
+
+// Handle a single newline-stripped command from a stream client
+void handle_stream_command(char *line, StreamBuffer *in)
+{
+    // Tolerate CRLF line endings
+    int len = strlen(line);
+    if (len > 0 && line[len - 1] == '\r')
+        line[--len] = '\0';
+
+    if (len == 0)
+        return; // Ignore empty lines
+
+    unsigned long long start = stats_now();
+    char command[16], atom[16], unknown[16] = ""; // Buffers for command and atom types
+    AddItem items[MAX_ADD_ITEMS];
+    int consumed = 0, count = 0;
+    bool valid = sscanf(line, "%15s%n", command, &consumed) == 1 && strcmp(command, "ADD") == 0;
+
+    if (!valid && consumed > 0 && strcmp(command, "GEN") == 0)
+    {
+        char reply[BUFFER_SIZE];
+        send_stream_reply(in, reply, handle_gen_request(line + consumed, "TCP / UDS stream", reply, sizeof(reply)));
+        return;
+    }
+
+    if (!valid && consumed > 0 && strcmp(command, "SUBSCRIBE") == 0)
+    {
+        handle_subscribe(line + consumed, in);
+        return;
+    }
+
+    if (!valid && consumed > 0 && strcmp(command, "UNSUBSCRIBE") == 0 && line[consumed] == '\0')
+    {
+        unsubscribe(in);
+        return;
+    }
+
+    // "ADD <ATOM> <amount> [<ATOM> <amount>...]": every pair up to the end of the line
+    for (const char *p = line + consumed; valid;)
+    {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+
+        unsigned long long amount;
+        if (count == MAX_ADD_ITEMS || sscanf(p, "%15s %llu%n", atom, &amount, &consumed) != 2)
+        {
+            valid = false;
+            break;
+        }
+        p += consumed;
+
+        items[count].atom = find_name(NAME_ATOM, atom);
+        items[count].amount = amount;
+        if (items[count].atom == -1 && !unknown[0])
+            strcpy(unknown, atom);
+        count++;
+    }
+
+    // Check if the command is valid
+    if (!valid || count == 0)
+    {
+        log_msg(LOG_WARN, "TCP / UDS stream: Invalid command: %s", line);
+        stat_inc(&stats.add_invalid);
+        return;
+    }
+
+    stats_lap(&stats.parse, start);
+
+    // Check if the atoms are valid
+    if (add_atom_batch(items, count))
+    {
+        log_msg(LOG_WARN, "TCP / UDS stream: Unknown atom type: %s", unknown);
+        return;
+    }
+}
+
+// Handle binary ADD frames from a stream client: a single frame, or a batch chained with
+// FRAME_MORE. complete is false if the chain went on past MAX_ADD_ITEMS frames.
+void handle_stream_frames(const BinaryFrame *frames, int count, bool complete, StreamBuffer *in)
+{
+    AddItem items[MAX_ADD_ITEMS];
+
+    if (count == 1 && frames[0].opcode == OP_GEN)
+    {
+        char reply[sizeof(BinaryFrame)];
+        send_stream_reply(in, reply, handle_binary_gen(&frames[0], "TCP / UDS stream", reply));
+        return;
+    }
+
+    if (!complete)
+    {
+        log_msg(LOG_WARN, "TCP / UDS stream: Binary ADD batch longer than %d frames", MAX_ADD_ITEMS);
+        stat_inc(&stats.add_invalid);
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (frames[i].magic != BINARY_MAGIC || frames[i].opcode != OP_ADD)
+        {
+            log_msg(LOG_WARN, "TCP / UDS stream: Invalid binary frame %d of %d: opcode %d", i, count, frames[i].opcode);
+            stat_inc(&stats.add_invalid);
+            return;
+        }
+
+        items[i].atom = (frames[i].item < ATOM_COUNT) ? frames[i].item : -1;
+        items[i].amount = le64toh(frames[i].amount);
+    }
+
+    if (add_atom_batch(items, count))
+        log_msg(LOG_WARN, "TCP / UDS stream: Unknown atom id in a batch of %d", count);
+}
+
+void copy_from_ring(const StreamBuffer *in, size_t pos, size_t len, char *out)
+{
+    const size_t mask = STREAM_BUFFER_SIZE - 1;
+    size_t start = pos & mask;
+    size_t first = (STREAM_BUFFER_SIZE - start < len) ? STREAM_BUFFER_SIZE - start : len;
+
+    memcpy(out, in->data + start, first);
+    memcpy(out + first, in->data, len - first);
+}
+
+// Answer a text command too long to be handled. It is dropped whole: a cut-off prefix could
+// still parse, e.g. as an ADD with a shortened amount.
+void reject_long_command(StreamBuffer *in, size_t len)
+{
+    static const char error[] = "ERROR: Command too long\n";
+
+    log_msg(LOG_WARN, "TCP / UDS stream: Command too long, discarding %zu bytes", len);
+    stat_inc(&stats.add_invalid);
+    send_stream_reply(in, error, sizeof(error) - 1);
+}
+
+// Handle every complete message in the buffer: a binary frame if it starts with BINARY_MAGIC,
+// a newline-terminated text command otherwise. With flush the unterminated text tail counts too.
+void parse_stream_buffer(StreamBuffer *in, bool flush)
+{
+    const size_t mask = STREAM_BUFFER_SIZE - 1;
+    char line[BUFFER_SIZE];
+
+    while (in->head < in->tail)
+    {
+        if (!in->skip_line && (unsigned char)in->data[in->head & mask] == BINARY_MAGIC)
+        {
+            BinaryFrame frames[MAX_ADD_ITEMS];
+            int count = 0;
+            bool complete = false;
+
+            // Collect the frame and every frame chained to it
+            while (count < MAX_ADD_ITEMS && !complete)
+            {
+                size_t pos = in->head + count * sizeof(BinaryFrame);
+                if (in->tail - pos < sizeof(BinaryFrame))
+                    return; // Wait for the rest of the batch
+
+                copy_from_ring(in, pos, sizeof(BinaryFrame), (char *)&frames[count]);
+                complete = !(frames[count++].flags & FRAME_MORE);
+            }
+
+            if (in->skip_batch)
+                in->skip_batch = !complete; // Still part of a batch that was already rejected
+            else
+            {
+                handle_stream_frames(frames, count, complete, in);
+                in->skip_batch = !complete;
+            }
+            in->head += count * sizeof(BinaryFrame);
+            in->scan = in->head;
+            continue;
+        }
+
+        while (in->scan < in->tail && in->data[in->scan & mask] != '\n')
+            in->scan++;
+
+        if (in->scan == in->tail && !flush)
+            return; // Keep the partial tail for the next read
+
+        size_t len = in->scan - in->head;
+        if (in->skip_line)
+            in->skip_line = false; // End of a command that was already rejected
+        else if (len > sizeof(line) - 1)
+            reject_long_command(in, len);
+        else
+        {
+            copy_from_ring(in, in->head, len, line);
+            line[len] = '\0';
+            handle_stream_command(line, in);
+        }
+        in->head = (in->scan < in->tail) ? in->scan + 1 : in->tail; // Consume the line including its newline
+        in->scan = in->head;
+    }
+}
+
+// Close a stream client's socket; its buffers are freed by the loop that owns them
+void close_stream_client(StreamBuffer *in)
+{
+    unsubscribe(in);
+    close(in->fd);
+    stat_inc(&stats.closed);
+}
+
+// Read and handle what a stream client sent. Returns 0 if the connection is still open, 1 if it was
+// closed, and -1 if nothing was read: the socket would block, or the client is not reading its replies.
+int handle_tcp_or_uds_stream_client(StreamBuffer *in)
+{
+    const size_t mask = STREAM_BUFFER_SIZE - 1;
+
+    if (stream_output_full(in))
+        return -1; // Backpressure: read on once the client took its replies
+
+    // A full buffer without a newline can never become a valid command, so drop it
+    if (in->tail - in->head == STREAM_BUFFER_SIZE)
+    {
+        if (!in->skip_line)
+            reject_long_command(in, STREAM_BUFFER_SIZE);
+        in->skip_line = true; // Up to the next newline
+        in->head = in->scan = in->tail;
+    }
+
+    // Read into the free part of the ring, which may wrap around the end
+    size_t start = in->tail & mask;
+    size_t free_space = STREAM_BUFFER_SIZE - (in->tail - in->head);
+    size_t first = STREAM_BUFFER_SIZE - start < free_space ? STREAM_BUFFER_SIZE - start : free_space;
+    struct iovec iov[2] = {
+        { .iov_base = in->data + start, .iov_len = first },
+        { .iov_base = in->data, .iov_len = free_space - first }
+    };
+
+    ssize_t bytes_read = readv(in->fd, iov, iov[1].iov_len ? 2 : 1); // Read data from the client
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return -1; // Nothing left to read on a non-blocking socket
+
+    // In case of an error or no data read, close the connection
+    if (bytes_read <= 0)
+    {
+        if (bytes_read == 0)
+            parse_stream_buffer(in, true); // The peer finished, so its last command needs no newline
+        close_stream_client(in);
+        return 1; // Connection closed
+    }
+
+    in->tail += bytes_read;
+    parse_stream_buffer(in, false); // Handle every complete command, keep the partial tail
+
+    return 0; // Connection still open
+}
+
+// A stream client's socket became writable: send what is queued, then a push that waited for room.
+// Returns 1 if the connection was closed.
+int handle_stream_output(StreamBuffer *in)
+{
+    if (flush_stream_output(in) < 0)
+    {
+        close_stream_client(in);
+        return 1;
+    }
+
+    deliver_push(in);
+    return 0;
+}
+
+int handle_stdin()
+{
+    char buffer[BUFFER_SIZE] = {0}; // Buffer to hold the incoming data
+
+    if (fgets(buffer, sizeof(buffer), stdin) == NULL)
+    {
+        if (ferror(stdin))
+            perror("fgets");
+        return 1; // Stop watching stdin
+    }
+
+    // Parse command for GEN
+    char command[16], drink[16];
+
+    // Extract just the command
+    if (sscanf(buffer, "%15s", command) != 1 || strcmp(command, "GEN") != 0)
+    {
+        log_msg(LOG_ALWAYS, "Invalid command: %s", buffer);
+        return 0;
+    }
+
+    // Find where the drink name starts (after "GEN ")
+    char *drink_part = buffer + strlen("GEN");
+    while (*drink_part == ' ' && *drink_part != '\0')
+    {
+        drink_part++;
+    }
+
+    // Copy the drink name (everything until newline)
+    snprintf(drink, sizeof(drink), "%.*s", (int)sizeof(drink) - 1, drink_part);
+
+    // Remove trailing newline and spaces
+    int len = strlen(drink);
+    while (len > 0 && (drink[len - 1] == '\n' || drink[len - 1] == ' ' || drink[len - 1] == '\r'))
+    {
+        drink[--len] = '\0';
+    }
+
+    if (len == 0)
+    {
+        log_msg(LOG_ALWAYS, "Missing drink name");
+        return 0;
+    }
+
+    int result;
+    unsigned long long amount = 0;
+
+    stat_inc(&stats.gen_requests);
+    result = get_amount_to_gen(drink, &amount); // Attempt to generate molecules (never blocks deliveries)
+
+    if (result == -1)
+    {
+        log_msg(LOG_ALWAYS, "Unknown drink type: %s", drink);
+        return 0;
+    }
+
+    if (amount == 0)
+    {
+        log_msg(LOG_ALWAYS, "Not enough atoms to generate any %s.", drink);
+    }
+
+    else
+    {
+        log_msg(LOG_ALWAYS, "You can generate %llu %s.", amount, drink);
+    }
+
+    return 0;
+}
+
+// Bitwise CRC-32 (IEEE), only ever run over a few dozen bytes at startup and shutdown
+uint32_t crc32(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+uint32_t header_checksum(const WarehouseHeader *header)
+{
+    return crc32(header, offsetof(WarehouseHeader, header_crc));
+}
+
+// Versions 2 and 3 had no journal generation, so their header CRC sits earlier
+bool legacy_header_valid(const WarehouseHeader *header)
+{
+    uint32_t crc;
+
+    memcpy(&crc, (const char *)header + V2_HEADER_CRC_OFFSET, sizeof(crc));
+    return crc == crc32(header, V2_HEADER_CRC_OFFSET);
+}
+
+uint32_t data_checksum()
+{
+    unsigned long long counters[WAREHOUSE_ATOM_SLOTS];
+
+    counters[0] = atomic_load(&warehouse->carbon);
+    counters[1] = atomic_load(&warehouse->oxygen);
+    counters[2] = atomic_load(&warehouse->hydrogen);
+    for (int i = ATOM_COUNT; i < WAREHOUSE_ATOM_SLOTS; i++)
+        counters[i] = atomic_load(&warehouse->atom_ext[i - ATOM_COUNT]);
+
+    return crc32(counters, sizeof(counters));
+}
+
+// Check the header of a mapped save file of the current size before serving anything from it.
+// Returns whether the counters were sealed by a clean close and still match their CRC.
+bool validate_save_file(bool alone)
+{
+    const WarehouseHeader *header = &warehouse->header;
+
+    if (header->magic != WAREHOUSE_MAGIC || header->header_crc != header_checksum(header)) {
+        fprintf(stderr, "Save file %s has a corrupted header\n", save_file_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (header->version != WAREHOUSE_VERSION || header->header_size != sizeof(WarehouseHeader) ||
+        header->file_size != sizeof(SharedWarehouse)) {
+        fprintf(stderr, "Save file %s has format version %u (%llu bytes), this build reads version %d\n",
+                save_file_path, header->version, (unsigned long long)header->file_size, WAREHOUSE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    // Processes joining must journal exactly when the one that opened the file does
+    if (!alone && (header->journal_generation != 0) != (journal_interval != 0)) {
+        fprintf(stderr, "Save file %s is in use %s --journal\n", save_file_path,
+                journal_interval ? "without" : "with");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only a cleanly closed file has a data CRC to check; after a crash the journal (if any) decides
+    if (!alone || !header->clean)
+        return false;
+
+    return header->data_crc == data_checksum();
+}
+
+// On shutdown: flush according to --sync-mode, and if this is the last process using the
+// file, seal the counters with a CRC so corruption at rest is caught on the next start
+void close_save_file()
+{
+    struct flock last = {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0
+    };
+
+    if (fcntl(fd, F_SETLK, &last) == 0) {
+        warehouse->header.data_crc = data_checksum();
+        warehouse->header.clean = 1;
+        warehouse->header.header_crc = header_checksum(&warehouse->header);
+        msync(warehouse, sizeof(SharedWarehouse), MS_SYNC);
+    }
+
+    else if (sync_mode != SYNC_NONE)
+        msync(warehouse, sizeof(SharedWarehouse), MS_SYNC); // Honor the policy for the last changes too
+}
+
+// Open and map the save file shared with other drinks_bar processes.
+// Every process holds a read lock on the file for its whole lifetime; the first one to start
+// gets the write lock instead, so it knows nobody else is using the mapping and can safely
+// (re)initialize the process-shared write lock before downgrading.
+void map_save_file()
+{
+    fd = open(save_file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct flock presence = {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0 // The whole file
+    };
+
+    bool alone = (fcntl(fd, F_SETLK, &presence) == 0);
+    if (!alone) {
+        presence.l_type = F_RDLCK;
+        fcntl(fd, F_SETLKW, &presence); // Waits until the first process finished initializing
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);  // Move to end to check size
+    AtomWarehouse legacy = {0};
+    uint32_t version = WAREHOUSE_VERSION;
+    bool init = (size != sizeof(SharedWarehouse));
+
+    // Version 3 files have the current size, only their header is shorter
+    if (!init && pread(fd, &version, sizeof(version), offsetof(WarehouseHeader, version)) == sizeof(version))
+        init = (version == 3);
+
+    if (init && !alone) {
+        fprintf(stderr, "Save file %s is in use with a different layout\n", save_file_path);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init) {
+        WarehouseHeader header;
+
+        // Older formats: version 0 holds just the three counters, version 1 has them after the lock
+        off_t counters = (size == sizeof(AtomWarehouse)) ? 0 : (size == V1_FILE_SIZE) ? V1_COUNTERS_OFFSET : -1;
+
+        // Files with a header say which release wrote them
+        if (size >= (off_t)sizeof(header) && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == WAREHOUSE_MAGIC) {
+            if (header.version == 2 && legacy_header_valid(&header))
+                counters = V2_COUNTERS_OFFSET;
+            else if (header.version == 3 && legacy_header_valid(&header))
+                counters = V3_COUNTERS_OFFSET;
+            else {
+                fprintf(stderr, "Save file %s has format version %u (%llu bytes), this build reads version %d\n",
+                        save_file_path, header.version, (unsigned long long)header.file_size, WAREHOUSE_VERSION);
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (size != 0 && counters < 0) {
+            fprintf(stderr, "Save file %s is not a warehouse (%lld bytes)\n", save_file_path, (long long)size);
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+
+        if (counters >= 0 && pread(fd, &legacy, sizeof(legacy), counters) != sizeof(legacy))
+            memset(&legacy, 0, sizeof(legacy));
+
+        // File is empty or an older version – initialize once
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(SharedWarehouse)) < 0) {
+            perror("ftruncate");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    warehouse = mmap(NULL, sizeof(SharedWarehouse),
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (warehouse == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (init) {
+        atomic_store(&warehouse->seq, 0);
+        atomic_store(&warehouse->carbon, legacy.carbon);
+        atomic_store(&warehouse->oxygen, legacy.oxygen);
+        atomic_store(&warehouse->hydrogen, legacy.hydrogen);
+
+        warehouse->header = (WarehouseHeader){
+            .magic = WAREHOUSE_MAGIC,
+            .version = WAREHOUSE_VERSION,
+            .header_size = sizeof(WarehouseHeader),
+            .file_size = sizeof(SharedWarehouse),
+            .atom_slots = WAREHOUSE_ATOM_SLOTS,
+            .molecule_slots = WAREHOUSE_MOLECULE_SLOTS
+        };
+        if (size != 0)
+            printf("Upgraded save file %s to format version %d\n", save_file_path, WAREHOUSE_VERSION);
+    }
+
+    bool sealed = init || validate_save_file(alone); // Fresh or upgraded counters are as good as it gets
+
+    if (alone) {
+        // A journal that continues this file's last run supersedes counters that were not sealed
+        uint64_t generation = 0;
+        bool corrupted = !sealed && warehouse->header.clean;
+
+        journal_paths();
+        bool recovered = !sealed && journal_recover(&generation);
+        if (corrupted && !recovered) {
+            fprintf(stderr, "Save file %s failed its checksum and has no journal to rebuild it from\n", save_file_path);
+            exit(EXIT_FAILURE);
+        }
+        if (corrupted)
+            printf("Save file %s failed its checksum, rebuilt it from the journal\n", save_file_path);
+        if (generation < warehouse->header.journal_generation)
+            generation = warehouse->header.journal_generation;
+
+        // A lock word left in the file by a previous run is meaningless now, start fresh
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&warehouse->write_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        if (atomic_load(&warehouse->seq) & 1)
+            atomic_fetch_add(&warehouse->seq, 1); // The previous run crashed mid-delivery
+
+        if (journal_interval)
+            journal_open(true, generation); // Nobody else is running, so recovery cannot race with appends
+        else
+            journal_discard();
+
+        // In use from now on: the counters will change without the data CRC following them
+        warehouse->header.clean = 0;
+        warehouse->header.header_crc = header_checksum(&warehouse->header);
+
+        presence.l_type = F_RDLCK;
+        fcntl(fd, F_SETLK, &presence); // Downgrade so other processes can join
+    }
+
+    else if (journal_interval) {
+        journal_paths();
+        journal_open(false, 0);
+    }
+}
+
+// poll() backend: scans the whole fds array on every wakeup
+void run_poll_loop(int timeout)
+{
+    // Allocate memory for the poll file descriptors
+    int fds_capacity = 10;
+    fds = malloc(fds_capacity * sizeof(struct pollfd));
+    if (!fds)
+    {
+        perror("malloc");
+
+        if (tcp_listener >= 0)
+            close(tcp_listener); // Close the TCP listener if it was created
+        else if (stream_path)
+            unlink(stream_path); // Remove the UDS stream socket file if it was created
+
+        if (udp_listener >= 0)
+            close(udp_listener); // Close the UDP listener if it was created
+        else if (datagram_path)
+            unlink(datagram_path); // Remove the UDS datagram socket file if it was created
+
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize the array to zero out all fields including revents
+    memset(fds, 0, fds_capacity * sizeof(struct pollfd));
+
+    fd_buffers = calloc(fds_capacity, sizeof(StreamBuffer *));
+    if (!fd_buffers)
+    {
+        perror("calloc");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    if (tcp_listener >= 0)
+    {
+        fds[0].fd = tcp_listener; // The first element is the listener socket
+        fds[0].events = POLLIN;   // Set the listener to poll for incoming connections
+    }
+
+    else if (uds_stream_listener >= 0)
+    {
+        fds[0].fd = uds_stream_listener; // The fourth element is the UDS stream socket for incoming data
+        fds[0].events = POLLIN;          // Set the UDS stream listener to poll for incoming data
+    }
+
+    if (udp_listener >= 0)
+    {
+        fds[1].fd = udp_listener; // The second element is the UDP socket for incoming data
+        fds[1].events = POLLIN;   // Set the UDP listener to poll for incoming data
+    }
+
+    else if (uds_dgram_fd >= 0)
+    {
+        fds[1].fd = uds_dgram_fd; // The fifth element is the UDS datagram socket for incoming data
+        fds[1].events = POLLIN;   // Set the UDS datagram listener to poll for incoming data
+    }
+
+    fds[2].fd = STDIN_FILENO; // The third element is the standard input for commands
+    fds[2].events = POLLIN;   // Set the stdin to poll for incoming data
+
+    if (open_wake_fd() < 0)
+    {
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+    fds[3].fd = wake_fd;    // The fourth element wakes the loop when a subscriber is due a push
+    fds[3].events = POLLIN;
+
+    // Main loop to accept and handle client connections
+    while (atomic_load(&running))
+    {
+        int ready = poll(fds, nfds, 1000); // Poll with a timeout so we can check running flag
+
+        if (!atomic_load(&running))
+            break; // Check if we need to exit
+
+        // Check if poll was successful
+        if (ready < 0)
+        {
+            perror("poll");
+            continue;
+        }
+
+        unsigned long long wakeup = ready > 0 ? stats_now() : 0;
+
+        // Check if the TCP or UDS stream listener socket has incoming connections
+        if (fds[0].revents & POLLIN)
+        {
+            if (timeout > 0)
+                alarm(timeout);                            // Reset the alarm for timeout
+            int client_fd = accept4(fds[0].fd, NULL, NULL, SOCK_NONBLOCK); // Accept a new client connection
+
+            // Check if the accept was successful
+            if (client_fd < 0)
+            {
+                perror("accept");
+                continue;
+            }
+
+            stat_inc(&stats.accepted);
+
+            // Resize the arrays if we're out of space
+            if (nfds >= fds_capacity)
+            {
+                struct pollfd *new_fds = realloc(fds, fds_capacity * 2 * sizeof(struct pollfd));
+                if (new_fds)
+                    fds = new_fds;
+
+                StreamBuffer **new_buffers = realloc(fd_buffers, fds_capacity * 2 * sizeof(StreamBuffer *));
+                if (new_buffers)
+                    fd_buffers = new_buffers;
+
+                if (!new_fds || !new_buffers)
+                {
+                    perror("realloc");
+                    close(client_fd);
+                    continue;
+                }
+                fds_capacity *= 2; // Double the capacity
+            }
+
+            StreamBuffer *in = new_stream_buffer(client_fd);
+            if (!in)
+            {
+                close(client_fd);
+                continue;
+            }
+
+            // Add the new client to the end of the array
+            fds[nfds].fd = client_fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            fd_buffers[nfds] = in;
+            nfds++;
+        }
+
+        // Check if the UDP listener socket has incoming connections
+        if (fds[1].revents & POLLIN && udp_listener >= 0)
+        {
+            if (timeout > 0)
+                alarm(timeout); // Reset the alarm for timeout
+            handle_udp_client(udp_listener);
+        }
+
+        // Check if the UDS stream listener socket has incoming connections
+        else if (fds[1].revents & POLLIN && uds_dgram_fd >= 0)
+        {
+            if (timeout > 0)
+                alarm(timeout); // Reset the alarm for timeout
+            handle_uds_datagram_client(uds_dgram_fd);
+        }
+
+        // Check if the stdin has data to read
+        if (fds[2].revents & POLLIN)
+        {
+            if (timeout > 0)
+                alarm(timeout); // Reset the alarm for timeout
+            if (handle_stdin())
+                fds[2].fd = -1; // poll() ignores negative descriptors
+        }
+
+        // Check if a subscriber of this loop is due a push
+        if (fds[3].revents & POLLIN)
+        {
+            drain_wake_fd();
+            for (int i = POLL_CLIENTS; i < nfds; i++)
+                deliver_push(fd_buffers[i]);
+        }
+
+        // Iterate through the file descriptors to handle client requests
+        for (int i = POLL_CLIENTS; i < nfds; i++)
+        {
+            int connection_closed = 0;
+
+            // Send queued replies once the client makes room for them
+            if (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+                connection_closed = handle_stream_output(fd_buffers[i]);
+
+            // Check if this fd has data to read
+            if (!connection_closed && (fds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                if (timeout > 0)
+                    alarm(timeout); // Reset the alarm for timeout
+                connection_closed = handle_tcp_or_uds_stream_client(fd_buffers[i]) == 1; // Handle the client request
+            }
+
+            if (connection_closed)
+            {
+                // Client order does not matter, so move the last entry into the gap
+                free_stream_buffer(fd_buffers[i]);
+                fds[i] = fds[nfds - 1];
+                fd_buffers[i] = fd_buffers[nfds - 1];
+                nfds--;
+                i--; // Adjust index so the moved entry is handled too
+                continue;
+            }
+
+            // Stop reading from a client that does not read its replies, until it caught up
+            fds[i].events = (stream_output_full(fd_buffers[i]) ? 0 : POLLIN) | (stream_output_pending(fd_buffers[i]) ? POLLOUT : 0);
         }
-    }
-    free(fds); // Free the allocated memory for file descriptors
-
-    if (stream_path)
-        unlink(stream_path); // Remove the UDS stream socket file
-    
-    if (datagram_path)
-        unlink(datagram_path); // Remove the UDS datagram socket file
 
-    if (save_file_path) {
-    munmap(warehouse, sizeof(AtomWarehouse));
-    close(fd);
-    }
-    
-    else {
-        free(warehouse);
+        stats_lap(&stats.loop, wakeup);
     }
 }
 
-// Signal handler for graceful shutdown
-void handle_signal(int sig)
+// Create a bound and listening TCP socket; with reuse_port several sockets can share the port
+int open_tcp_listener(int port, bool reuse_port)
 {
-    running = 0;
-}
+    int listener = socket(AF_INET, SOCK_STREAM, 0); // Create a TCP socket
 
-void handle_timeout(int sig)
-{
-    if (tcp_listener >= 0)
-        close(tcp_listener);
-    if (udp_listener >= 0)
-        close(udp_listener);
+    // Check if the socket was created successfully
+    if (listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
 
-    if (fds != NULL)
+    // Set socket option to reuse address to avoid "address already in use"
+    int opt = 1;
+    if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuse_port && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0))
     {
-        cleanup(fds, 3); // Clean up the file descriptors
+        perror("setsockopt");
+        close(listener);
+        return -1;
     }
 
-    printf("Server shutting down after timeout.\n");
-    exit(0);
-}
+    struct sockaddr_in tcp_address = {0};        // Initialize the address structure
+    socklen_t tcp_addrlen = sizeof(tcp_address); // Size of the address structure
+    tcp_address.sin_family = AF_INET;            // Set the address family to IPv4
+    tcp_address.sin_addr.s_addr = INADDR_ANY;    // Bind to any available address
+    tcp_address.sin_port = htons(port);          // Convert the port number to network byte order
 
-void print_status() 
-{
-    struct flock lock;
-    
-    if (fd >= 0) {
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = sizeof(AtomWarehouse);
-        fcntl(fd, F_SETLKW, &lock);
+    // Bind the socket to the address and port (TCP)
+    if (bind(listener, (struct sockaddr *)&tcp_address, tcp_addrlen) < 0)
+    {
+        perror("bind");
+        close(listener); // Close the TCP socket
+        return -1;
     }
-    
-    printf("Atom Warehouse Status:\n");
-    printf("Carbon: %llu\n", warehouse->carbon);
-    printf("Oxygen: %llu\n", warehouse->oxygen);
-    printf("Hydrogen: %llu\n", warehouse->hydrogen);
 
-    if (fd>=0) {
-        lock.l_type = F_UNLCK;
-        fcntl(fd, F_SETLKW, &lock);
+    // Set the socket to listen for incoming connections (TCP)
+    if (listen(listener, SOMAXCONN) < 0)
+    { // SOMAXCONN is the maximum queue length for pending connections
+        perror("listen");
+        close(listener);
+        return -1;
     }
+
+    return listener;
 }
 
-int add_atoms(const char *atom, unsigned long long amount)
+// Create a bound UDP socket; with reuse_port the kernel spreads datagrams over all sockets on the port
+int open_udp_socket(int port, bool reuse_port)
 {
-    if (fd >= 0) {
-        struct flock lock = {
-            .l_type = F_WRLCK,
-            .l_whence = SEEK_SET,
-            .l_start = 0,
-            .l_len = sizeof(AtomWarehouse)
-        };
+    int sock = socket(AF_INET, SOCK_DGRAM, 0); // Create a UDP socket
 
-        fcntl(fd, F_SETLKW, &lock); // Lock the file for writing
+    // Check if the UDP socket was created successfully
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
 
-        if (strcmp(atom, "CARBON") == 0)
-            warehouse->carbon += amount;
-        else if (strcmp(atom, "OXYGEN") == 0)
-            warehouse->oxygen += amount;
-        else if (strcmp(atom, "HYDROGEN") == 0)
-            warehouse->hydrogen += amount;
-        else
-            return 1; // Unknown atom type
+    int opt = 1;
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        perror("setsockopt");
+        close(sock);
+        return -1;
+    }
 
-        // Unlock the file after writing
-        lock.l_type = F_UNLCK;
-        fcntl(fd, F_SETLKW, &lock);
+    // For UDP binding, create a new address structure
+    struct sockaddr_in udp_address = {0};        // Initialize UDP address structure
+    socklen_t udp_addrlen = sizeof(udp_address); // Size of the address structure
+    udp_address.sin_family = AF_INET;            // Set the address family to IPv4
+    udp_address.sin_addr.s_addr = INADDR_ANY;    // Bind to any available address
+    udp_address.sin_port = htons(port);          // Use the UDP port number
 
-        return 0;     // Successfully added atoms
+    // Bind the socket to the address and port (UDP)
+    if (bind(sock, (struct sockaddr *)&udp_address, udp_addrlen) < 0)
+    {
+        perror("bind");
+        close(sock); // Close the UDP socket
+        return -1;
     }
 
-    // If file descriptor is not set, just update the warehouse in memory
-    else {
-        if (strcmp(atom, "CARBON") == 0)
-            warehouse->carbon += amount;
-        else if (strcmp(atom, "OXYGEN") == 0)
-            warehouse->oxygen += amount;
-        else if (strcmp(atom, "HYDROGEN") == 0)
-            warehouse->hydrogen += amount;
-        else
-            return 1; // Unknown atom type
-        return 0;
-    }
+    return sock;
 }
 
-int get_amount_of_molecules(const char *molecule)
+// Open the --stats listener: a TCP port if spec is a number, a UDS stream path otherwise
+int open_stats_listener(const char *spec)
 {
-    int res = 0; // Initialize the result to 0
-
-    // Check the type of molecule and calculate the maximum number that can be created
-    if (strcmp(molecule, "WATER") == 0)
+    if (spec[strspn(spec, "0123456789")] == '\0')
     {
-        while (warehouse->hydrogen >= 2 * (res + 1) && warehouse->oxygen >= (res + 1))
+        int port = atoi(spec);
+        if (port <= 0 || port > 65535)
         {
-            res++;
+            fprintf(stderr, "Invalid port number: %s\n", spec);
+            return -1;
         }
+        return open_tcp_listener(port, false);
     }
 
-    else if (strcmp(molecule, "CARBON DIOXIDE") == 0)
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(spec) >= sizeof(addr.sun_path))
     {
-        while (warehouse->carbon >= (res + 1) && warehouse->oxygen >= 2 * (res + 1))
-        {
-            res++;
-        }
+        fprintf(stderr, "Stats socket path too long: %s\n", spec);
+        return -1;
     }
 
-    else if (strcmp(molecule, "ALCOHOL") == 0)
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
     {
-        while (warehouse->carbon >= 2 * (res + 1) && warehouse->hydrogen >= 6 * (res + 1) && warehouse->oxygen >= (res + 1))
-        {
-            res++;
-        }
+        perror("socket (stats)");
+        return -1;
     }
 
-    else if (strcmp(molecule, "GLUCOSE") == 0)
+    strncpy(addr.sun_path, spec, sizeof(addr.sun_path) - 1);
+    unlink(spec); // Remove existing socket file (ignore errors here)
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, SOMAXCONN) < 0)
     {
-        while (warehouse->carbon >= 6 * (res + 1) && warehouse->hydrogen >= 12 * (res + 1) && warehouse->oxygen >= 6 * (res + 1))
-        {
-            res++;
-        }
+        perror("bind (stats)");
+        close(listener);
+        return -1;
     }
 
-    else
-        return -1; // Unknown molecule type
+    stats_path = strdup(spec);
+    return listener;
+}
 
-    return res; // Return the maximum number of molecules that can be created
+// Make a descriptor non-blocking (required by the edge-triggered backend, which drains until EAGAIN)
+int set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int deliver_molecules(const char *molecule, unsigned long long amount)
+// Allocate a state object for a descriptor and link it into the connection list
+Connection *new_connection(int fd, ConnectionType type)
 {
-    struct flock lock;
-    if (fd >= 0) {
-        lock.l_type = F_WRLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = sizeof(AtomWarehouse);
-        fcntl(fd, F_SETLKW, &lock); // Lock the file for writing
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn)
+    {
+        perror("calloc");
+        return NULL;
     }
 
-    int potential_amount = get_amount_of_molecules(molecule); // Get the maximum number of molecules that can be created
+    conn->fd = fd;
+    conn->type = type;
 
-    if (potential_amount == -1)
+    if (type == CONN_CLIENT && !(conn->in = new_stream_buffer(fd)))
     {
-        if (fd >= 0) {
-            lock.l_type = F_UNLCK;
-            fcntl(fd, F_SETLKW, &lock);
-        }
-        return 1; // Unknown molecule type
+        free(conn);
+        return NULL;
     }
 
-    else if (potential_amount < amount)
-    {
-        if (fd >= 0) {
-            lock.l_type = F_UNLCK;
-            fcntl(fd, F_SETLKW, &lock);
-        }
-        return -1; // Not enough atoms to create the requested amount of molecules
-    }
+    conn->prev = NULL;
+    conn->next = connections;
+    if (connections)
+        connections->prev = conn;
+    connections = conn;
 
-    if (strcmp(molecule, "WATER") == 0)
-    {
-        warehouse->hydrogen -= 2 * amount;
-        warehouse->oxygen -= amount;
-    }
+    return conn;
+}
 
-    else if (strcmp(molecule, "CARBON DIOXIDE") == 0)
-    {
-        warehouse->carbon -= amount;
-        warehouse->oxygen -= 2 * amount;
-    }
+// Unlink and free a connection; the descriptor must already be closed or deregistered
+void remove_connection(Connection *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        connections = conn->next;
 
-    else if (strcmp(molecule, "ALCOHOL") == 0)
-    {
-        warehouse->carbon -= 2 * amount;
-        warehouse->hydrogen -= 6 * amount;
-        warehouse->oxygen -= amount;
-    }
+    if (conn->next)
+        conn->next->prev = conn->prev;
 
-    else if (strcmp(molecule, "GLUCOSE") == 0)
+    free_stream_buffer(conn->in);
+    free(conn);
+}
+
+// Register a descriptor with epoll and link its state object into the connection list
+Connection *add_connection(int fd, ConnectionType type, uint32_t events)
+{
+    Connection *conn = new_connection(fd, type);
+    if (!conn)
+        return NULL;
+
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = conn; // Events carry the state object, not an array position
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
     {
-        warehouse->carbon -= 6 * amount;
-        warehouse->hydrogen -= 12 * amount;
-        warehouse->oxygen -= 6 * amount;
+        remove_connection(conn);
+        return NULL;
     }
 
-    if (fd >= 0) {
-        // Unlock the file after writing
-        lock.l_type = F_UNLCK;
-        fcntl(fd, F_SETLKW, &lock);
-    }
+    conn->events = events;
+    return conn;
+}
+
+// Watch a stream client for what it needs next: input unless it is behind on reading its
+// replies, and output while some are queued
+void update_interest(Connection *conn, bool edge_triggered)
+{
+    uint32_t events = (stream_output_full(conn->in) ? 0 : EPOLLIN) |
+                      (stream_output_pending(conn->in) ? EPOLLOUT : 0) | (edge_triggered ? EPOLLET : 0);
+
+    if (events == conn->events)
+        return;
 
-    return 0; // Successfully added molecules
+    // Modifying also re-reports readiness, so in edge-triggered mode unread input is not lost
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        perror("epoll_ctl (client)");
+    else
+        conn->events = events;
 }
 
-void handle_udp_client(int fd)
+// Handle one readiness event; in edge-triggered mode keep going until the descriptor would block
+void handle_connection_event(Connection *conn, uint32_t events, bool edge_triggered)
 {
-    char buffer[BUFFER_SIZE] = {0}; // Buffer to hold the incoming data
-    struct sockaddr_in client_addr;
-    socklen_t addrlen = sizeof(client_addr);
+    uint32_t client_events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+
+    switch (conn->type)
+    {
+    case CONN_STREAM_LISTENER:
+        do
+        {
+            int client_fd = accept4(conn->fd, NULL, NULL, SOCK_NONBLOCK); // Accept a new client connection
 
-    // Read data from the client (leaving space for null terminator)
-    int bytes = recvfrom(fd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addrlen);
+            if (client_fd < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    perror("accept");
+                break;
+            }
+
+            stat_inc(&stats.accepted);
+
+            if (!add_connection(client_fd, CONN_CLIENT, client_events))
+            {
+                perror("epoll_ctl");
+                close(client_fd);
+            }
+        } while (edge_triggered);
+        break;
+
+    case CONN_UDP:
+        do
+        {
+            if (handle_udp_client(conn->fd) < 0)
+                break;
+        } while (edge_triggered);
+        break;
+
+    case CONN_UDS_DATAGRAM:
+        do
+        {
+            if (handle_uds_datagram_client(conn->fd) < 0)
+                break;
+        } while (edge_triggered);
+        break;
+
+    case CONN_STDIN:
+        if (handle_stdin())
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL); // Stop watching stdin after EOF
+            remove_connection(conn);
+        }
+        break;
+
+    case CONN_WAKE:
+        drain_wake_fd();
+        for (Connection *client = connections; client != NULL; client = client->next)
+        {
+            if (client->type == CONN_CLIENT)
+            {
+                deliver_push(client->in);
+                update_interest(client, edge_triggered);
+            }
+        }
+        break;
 
-    if (bytes <= 0)
+    case CONN_CLIENT:
     {
-        perror("recvfrom");
-        close(fd);
-        return;
-    }
+        int res = 0;
 
-    buffer[bytes] = '\0'; // Ensure null-termination of the received string
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            res = handle_stream_output(conn->in);
 
-    // Parse command for DELIVER
-    char command[16], molecule[32];
-    unsigned long long amount;
+        while (res == 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            res = handle_tcp_or_uds_stream_client(conn->in); // Handle the client request
+            if (!edge_triggered)
+                break;
+        }
 
-    // Used %[^0-9] to read everything that's not a digit as molecule name
-    int parsed = sscanf(buffer, "%15s %31[^0-9] %llu", command, molecule, &amount);
+        if (res == 1)
+            remove_connection(conn); // Closing the socket already removed it from the epoll set
+        else
+            update_interest(conn, edge_triggered);
+        break;
+    }
+    }
+}
 
-    // Check if the command is valid
-    if (parsed != 3 || strcmp(command, "DELIVER") != 0)
+// epoll backend: only ready descriptors are reported, and connections are added/removed in O(1).
+// The primary loop also watches stdin; worker loops only serve sockets.
+void run_epoll_loop(int stream_fd, int dgram_fd, bool primary, int timeout, bool edge_triggered)
+{
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
     {
-        printf("UDP: Invalid command: %s\n", buffer);
-        const char *msg = "ERROR: Invalid command\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        return;
+        perror("epoll_create1");
+        cleanup();
+        exit(EXIT_FAILURE);
     }
 
-    // Trim trailing spaces from molecule name
-    int len = strlen(molecule);
-    while (len > 0 && molecule[len - 1] == ' ')
+    uint32_t socket_events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+    ConnectionType dgram_type = (uds_dgram_fd >= 0) ? CONN_UDS_DATAGRAM : CONN_UDP;
+
+    if (edge_triggered)
     {
-        molecule[--len] = '\0';
+        set_non_blocking(stream_fd);
+        set_non_blocking(dgram_fd);
     }
 
-    // Attempt to deliver molecules
-    int result = deliver_molecules(molecule, amount);
+    if (!add_connection(stream_fd, CONN_STREAM_LISTENER, socket_events) ||
+        !add_connection(dgram_fd, dgram_type, socket_events))
+    {
+        perror("epoll_ctl");
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
 
-    if (result == 0)
+    if (open_wake_fd() < 0 || !add_connection(wake_fd, CONN_WAKE, EPOLLIN))
     {
-        const char *msg = "DELIVERED\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDP: Delivered %llu %s molecules\n", amount, molecule);
+        perror("epoll_ctl (wake-up)");
+        cleanup();
+        exit(EXIT_FAILURE);
     }
 
-    else if (result == 1)
+    // stdin stays level-triggered since fgets() may buffer more than one line
+    if (primary && !add_connection(STDIN_FILENO, CONN_STDIN, EPOLLIN))
     {
-        const char *msg = "ERROR: Unknown molecule type\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDP: Unknown molecule type: %s\n", molecule);
+        if (errno == EPERM)
+            log_msg(LOG_WARN, "stdin does not support epoll, GEN commands are disabled");
+        else
+            perror("epoll_ctl (stdin)");
     }
 
-    else if (result == -1)
+    struct epoll_event events[64];
+
+    // Main loop to accept and handle client connections
+    while (atomic_load(&running))
     {
-        const char *msg = "NOT ENOUGH ATOMS\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDP: Not enough atoms for %llu %s molecules\n", amount, molecule);
+        int ready = epoll_wait(epoll_fd, events, 64, 1000); // Wait with a timeout so we can check running flag
+
+        if (!atomic_load(&running))
+            break; // Check if we need to exit
+
+        // Check if epoll_wait was successful
+        if (ready < 0)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        if (ready > 0 && timeout > 0)
+            alarm(timeout); // Reset the alarm for timeout
+
+        unsigned long long wakeup = ready > 0 ? stats_now() : 0;
+
+        for (int i = 0; i < ready; i++)
+        {
+            handle_connection_event(events[i].data.ptr, events[i].events, edge_triggered);
+        }
+
+        stats_lap(&stats.loop, wakeup);
     }
+}
 
-    if(fd == -1) print_status(); // Print the current status of the warehouse
+// Release everything uring_init() set up
+void uring_free(Uring *r)
+{
+    if (r->buffers)
+        munmap(r->buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+    if (r->buf_ring)
+        munmap(r->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    if (r->sqes)
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_size);
+    if (r->fd >= 0)
+        close(r->fd);
+
+    *r = (Uring){ .fd = -1 };
 }
 
-void handle_uds_datagram_client(int fd)
+// Hand a provided buffer (back) to the kernel
+void uring_recycle_buffer(Uring *r, unsigned short bid)
 {
-    char buffer[BUFFER_SIZE] = {0}; // Buffer to hold the incoming data
-    struct sockaddr_un client_addr;
-    socklen_t addrlen = sizeof(client_addr);
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUFFERS - 1)];
 
-    // Read data from the client (leaving space for null terminator)
-    int bytes = recvfrom(fd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addrlen);
+    buf->addr = (unsigned long)(r->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
 
-    if (bytes <= 0)
-    {
-        perror("recvfrom");
-        close(fd);
-        return;
-    }
+// Create a ring and register the provided buffers; returns -1 (with errno set) if the
+// kernel lacks io_uring or one of the features the loop relies on
+int uring_init(Uring *r)
+{
+    struct io_uring_params p;
 
-    buffer[bytes] = '\0'; // Ensure null-termination of the received string
+    memset(&p, 0, sizeof(p));
+    *r = (Uring){ .fd = -1 };
 
-    // Parse command for DELIVER
-    char command[16], molecule[32];
-    unsigned long long amount;
+    r->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
 
-    // Used %[^0-9] to read everything that's not a digit as molecule name
-    int parsed = sscanf(buffer, "%15s %31[^0-9] %llu", command, molecule, &amount);
+    r->entries = p.sq_entries;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
 
-    // Check if the command is valid
-    if (parsed != 3 || strcmp(command, "DELIVER") != 0)
+    // Newer kernels share one mapping between the two rings
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
     {
-        printf("UDS datagram: Invalid command: %s\n", buffer);
-        const char *msg = "ERROR: Invalid command\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        return;
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
     }
 
-    // Trim trailing spaces from molecule name
-    int len = strlen(molecule);
-    while (len > 0 && molecule[len - 1] == ' ')
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
     {
-        molecule[--len] = '\0';
+        r->sq_map = NULL;
+        goto fail;
     }
 
-    // Attempt to deliver molecules
-    int result = deliver_molecules(molecule, amount);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+    {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+        {
+            r->cq_map = NULL;
+            goto fail;
+        }
+    }
 
-    if (result == 0)
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
     {
-        const char *msg = "DELIVERED\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDS datagram: Delivered %llu %s molecules\n", amount, molecule);
+        r->sqes = NULL;
+        goto fail;
     }
 
-    else if (result == 1)
+    r->sq_head = (unsigned *)((char *)r->sq_map + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+
+    // Provided buffer ring: stream receives take a buffer only once data has arrived,
+    // so idle connections cost no receive memory
+    r->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf_ring == MAP_FAILED || r->buffers == MAP_FAILED)
     {
-        const char *msg = "ERROR: Unknown molecule type\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDS datagram: Unknown molecule type: %s\n", molecule);
+        if (r->buf_ring == MAP_FAILED)
+            r->buf_ring = NULL;
+        if (r->buffers == MAP_FAILED)
+            r->buffers = NULL;
+        goto fail;
     }
 
-    else if (result == -1)
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long)r->buf_ring,
+        .ring_entries = URING_BUFFERS,
+        .bgid = 0
+    };
+
+    if (syscall(SYS_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+
+    for (int i = 0; i < URING_BUFFERS; i++)
+        uring_recycle_buffer(r, i);
+
+    return 0;
+
+fail:
     {
-        const char *msg = "NOT ENOUGH ATOMS\n";
-        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&client_addr, addrlen);
-        printf("UDS datagram: Not enough atoms for %llu %s molecules\n", amount, molecule);
+        int saved = errno;
+        uring_free(r);
+        errno = saved;
+        return -1;
     }
+}
 
-    print_status(); // Print the current status of the warehouse
+// Push queued entries to the kernel and wait for at least wait_for completions
+int uring_submit(Uring *r, unsigned wait_for)
+{
+    unsigned to_submit = r->sq_local_tail - *r->sq_tail;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+    return syscall(SYS_io_uring_enter, r->fd, to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 }
 
-int handle_tcp_or_uds_stream_client(int fd)
+// Get a zeroed submission entry, flushing the queue to the kernel first if it is full
+struct io_uring_sqe *uring_get_sqe(Uring *r)
 {
-    char buffer[BUFFER_SIZE] = {0};                     // Buffer to hold the incoming data
-    int bytes_read = read(fd, buffer, BUFFER_SIZE - 1); // Read data from the client (leaving space for null terminator)
+    if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries)
+        uring_submit(r, 0);
 
-    // In case of an error or no data read, close the connection
-    if (bytes_read <= 0)
-    {
-        close(fd);
-        return 1; // Connection closed
-    }
+    unsigned index = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+    return sqe;
+}
 
-    char command[16], atom[16];                                            // Buffers for command and atom type
-    unsigned long long amount;                                             // Variable to hold the amount of atoms
-    int parsed = sscanf(buffer, "%15s %15s %llu", command, atom, &amount); // Parse the command, atom type, and amount from the buffer
+// user_data values that are not connections
+#define URING_TICK 1 // The once-a-second timeout
+#define URING_CANCEL 2 // Completions of cancel requests, nothing to do
+#define URING_WRITABLE 1 // Tags a client's POLLOUT request (connections are aligned, so the bit is free)
 
-    // Check if the command is valid
-    if (parsed != 3 || strcmp(command, "ADD") != 0)
-    {
-        printf("TCP / UDS stream: Invalid command: %s", buffer);
-        return 0; // Connection still open
-    }
+// Arm the operation that reports events for a connection. Listeners and stream clients use
+// multishot requests, so a single submission keeps producing completions until it ends.
+void uring_arm(Uring *r, Connection *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->fd = conn->fd;
+    sqe->user_data = (unsigned long)conn;
 
-    // Check if the amount is valid
-    if (add_atoms(atom, amount))
+    switch (conn->type)
     {
-        printf("TCP / UDS stream: Unknown atom type: %s\n", atom);
-        return 0; // Connection still open
+    case CONN_STREAM_LISTENER:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        break;
+
+    case CONN_CLIENT:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        break;
+
+    case CONN_UDP:
+    case CONN_UDS_DATAGRAM:
+    case CONN_WAKE:
+        // Readiness only: the batch handler drains the socket with recvmmsg/sendmmsg
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+
+    case CONN_STDIN:
+        sqe->opcode = IORING_OP_POLL_ADD; // One-shot, re-armed after each line
+        sqe->poll32_events = POLLIN;
+        break;
     }
+}
 
-    if(fd == -1) print_status(); // Print the current status of the warehouse
-    return 0; // Connection still open
+void uring_arm_tick(Uring *r)
+{
+    static const struct __kernel_timespec tick = { .tv_sec = 1 };
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
 }
 
-int min3(int a, int b, int c)
+// Cancel the request carrying the given user data
+void uring_cancel(Uring *r, unsigned long target)
 {
-    int min = a;
-    if (b < min)
-        min = b;
-    if (c < min)
-        min = c;
-    return min;
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = target;
+    sqe->user_data = URING_CANCEL;
 }
 
-int get_amount_to_gen(const char *drink)
+// Keep a stream client's requests in line with its buffers: receive unless it is behind on
+// reading its replies, and wait for the socket to become writable while output is queued
+void uring_update_client(Uring *r, Connection *conn)
 {
-    if (strcmp(drink, "SOFT DRINK") == 0)
+    bool full = stream_output_full(conn->in);
+
+    if (stream_output_pending(conn->in) && !conn->polling_out)
     {
-        return min3(get_amount_of_molecules("WATER"),
-                    get_amount_of_molecules("CARBON DIOXIDE"),
-                    get_amount_of_molecules("GLUCOSE"));
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+        sqe->opcode = IORING_OP_POLL_ADD; // One-shot, re-armed while output remains
+        sqe->fd = conn->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = (unsigned long)conn | URING_WRITABLE;
+        conn->polling_out = true;
+        conn->ops++;
     }
 
-    else if (strcmp(drink, "VODKA") == 0)
+    if (!full && !conn->receiving)
     {
-        return min3(get_amount_of_molecules("WATER"),
-                    get_amount_of_molecules("ALCOHOL"),
-                    get_amount_of_molecules("GLUCOSE"));
+        uring_arm(r, conn);
+        conn->receiving = true;
+        conn->ops++;
     }
-
-    else if (strcmp(drink, "CHAMPAGNE") == 0)
+    else if (full && conn->receiving && !conn->cancelling)
     {
-        return min3(get_amount_of_molecules("WATER"),
-                    get_amount_of_molecules("CARBON DIOXIDE"),
-                    get_amount_of_molecules("ALCOHOL"));
+        uring_cancel(r, (unsigned long)conn); // Received data still in flight is handled, then it stops
+        conn->cancelling = true;
     }
+}
 
-    else
-        return -1; // Unknown drink type
+// Close a stream client; its state is freed once every request it has in flight completed
+void uring_close_client(Uring *r, Connection *conn)
+{
+    close_stream_client(conn->in);
+    conn->closing = true;
+
+    if (conn->receiving && !conn->cancelling)
+        uring_cancel(r, (unsigned long)conn);
+    if (conn->polling_out)
+        uring_cancel(r, (unsigned long)conn | URING_WRITABLE);
 }
 
-void handle_stdin()
+// Append received bytes to a client's ring buffer, handling commands as they complete
+void feed_stream_buffer(StreamBuffer *in, const char *data, size_t len)
 {
-    char buffer[BUFFER_SIZE] = {0}; // Buffer to hold the incoming data
+    const size_t mask = STREAM_BUFFER_SIZE - 1;
 
-    if (fgets(buffer, sizeof(buffer), stdin) == NULL)
+    while (len > 0)
     {
-        if (ferror(stdin))
-            perror("fgets");
-        return;
+        // A full buffer without a newline can never become a valid command, so drop it
+        if (in->tail - in->head == STREAM_BUFFER_SIZE)
+        {
+            if (!in->skip_line)
+                reject_long_command(in, STREAM_BUFFER_SIZE);
+            in->skip_line = true; // Up to the next newline
+            in->head = in->scan = in->tail;
+        }
+
+        size_t start = in->tail & mask;
+        size_t chunk = STREAM_BUFFER_SIZE - (in->tail - in->head);
+        if (chunk > STREAM_BUFFER_SIZE - start)
+            chunk = STREAM_BUFFER_SIZE - start;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(in->data + start, data, chunk);
+        in->tail += chunk;
+        data += chunk;
+        len -= chunk;
+
+        parse_stream_buffer(in, false);
     }
+}
 
-    // Parse command for GEN
-    char command[16], drink[16];
+// Handle one completion; a multishot request that ends (no IORING_CQE_F_MORE) is re-armed
+void handle_uring_completion(Uring *r, const struct io_uring_cqe *cqe)
+{
+    Connection *conn = (Connection *)(unsigned long)(cqe->user_data & ~(unsigned long long)URING_WRITABLE);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
 
-    // Extract just the command
-    if (sscanf(buffer, "%15s", command) != 1 || strcmp(command, "GEN") != 0)
+    switch (conn->type)
     {
-        printf("Invalid command: %s\n", buffer);
-        return;
+    case CONN_STREAM_LISTENER:
+        if (cqe->res >= 0)
+        {
+            stat_inc(&stats.accepted);
+
+            Connection *client = new_connection(cqe->res, CONN_CLIENT);
+            if (client)
+                uring_update_client(r, client);
+            else
+                close(cqe->res);
+        }
+        else
+            log_msg(LOG_ERROR, "accept: %s", strerror(-cqe->res));
+
+        if (!more)
+            uring_arm(r, conn);
+        break;
+
+    case CONN_CLIENT:
+        if (cqe->user_data & URING_WRITABLE)
+        {
+            conn->polling_out = false;
+            conn->ops--;
+
+            if (!conn->closing && cqe->res >= 0)
+            {
+                if (flush_stream_output(conn->in) < 0)
+                    uring_close_client(r, conn);
+                else
+                    deliver_push(conn->in);
+            }
+        }
+        else
+        {
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+                if (cqe->res > 0 && !conn->closing)
+                    feed_stream_buffer(conn->in, r->buffers + (size_t)bid * URING_BUFFER_SIZE, cqe->res);
+                uring_recycle_buffer(r, bid);
+            }
+
+            if (!more)
+            {
+                // Out of provided buffers (-ENOBUFS), cancelled, or the kernel ended the multishot
+                conn->receiving = conn->cancelling = false;
+                conn->ops--;
+            }
+
+            if (!conn->closing && (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)))
+            {
+                if (cqe->res == 0)
+                    parse_stream_buffer(conn->in, true); // The peer finished, so its last command needs no newline
+                else
+                    log_msg(LOG_ERROR, "recv: %s", strerror(-cqe->res));
+
+                uring_close_client(r, conn);
+            }
+        }
+
+        if (!conn->closing)
+            uring_update_client(r, conn); // Re-arms what ended, follows the output queue
+        else if (conn->ops == 0)
+            remove_connection(conn);
+        break;
+
+    case CONN_WAKE:
+        drain_wake_fd();
+        for (Connection *client = connections; client != NULL; client = client->next)
+        {
+            if (client->type == CONN_CLIENT && !client->closing)
+            {
+                deliver_push(client->in);
+                uring_update_client(r, client);
+            }
+        }
+        if (!more)
+            uring_arm(r, conn);
+        break;
+
+    case CONN_UDP:
+        while (handle_udp_client(conn->fd) == 0)
+            ; // Drain every queued datagram
+        if (!more)
+            uring_arm(r, conn);
+        break;
+
+    case CONN_UDS_DATAGRAM:
+        while (handle_uds_datagram_client(conn->fd) == 0)
+            ;
+        if (!more)
+            uring_arm(r, conn);
+        break;
+
+    case CONN_STDIN:
+        if (handle_stdin())
+            remove_connection(conn); // EOF: the one-shot poll is not re-armed
+        else
+            uring_arm(r, conn);
+        break;
     }
+}
 
-    // Find where the drink name starts (after "GEN ")
-    char *drink_part = buffer + strlen("GEN");
-    while (*drink_part == ' ' && *drink_part != '\0')
+// io_uring backend: listeners and clients each have one multishot request outstanding,
+// so the steady state is one io_uring_enter per batch of completions instead of a
+// readiness syscall plus a read per event. The primary loop also watches stdin.
+void run_uring_loop(int stream_fd, int dgram_fd, bool primary, int timeout)
+{
+    if (uring_init(&ring) < 0)
     {
-        drink_part++;
+        perror("io_uring_setup");
+        cleanup();
+        exit(EXIT_FAILURE);
     }
 
-    // Copy the drink name (everything until newline)
-    strcpy(drink, drink_part);
+    ConnectionType dgram_type = (uds_dgram_fd >= 0) ? CONN_UDS_DATAGRAM : CONN_UDP;
+    Connection *listener = new_connection(stream_fd, CONN_STREAM_LISTENER);
+    Connection *dgram = new_connection(dgram_fd, dgram_type);
+    Connection *input = primary ? new_connection(STDIN_FILENO, CONN_STDIN) : NULL;
+    Connection *wake = open_wake_fd() >= 0 ? new_connection(wake_fd, CONN_WAKE) : NULL;
 
-    // Remove trailing newline and spaces
-    int len = strlen(drink);
-    while (len > 0 && (drink[len - 1] == '\n' || drink[len - 1] == ' ' || drink[len - 1] == '\r'))
+    if (!listener || !dgram || (primary && !input) || !wake)
     {
-        drink[--len] = '\0';
+        cleanup();
+        exit(EXIT_FAILURE);
     }
 
-    if (len == 0)
+    uring_arm(&ring, listener);
+    uring_arm(&ring, dgram);
+    uring_arm(&ring, wake);
+    if (input)
+        uring_arm(&ring, input);
+    uring_arm_tick(&ring);
+
+    // Main loop to accept and handle client connections
+    while (atomic_load(&running))
     {
-        printf("Missing drink name\n");
-        return;
-    }
+        if (uring_submit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY)
+            perror("io_uring_enter");
 
-    int result;
-    struct flock lock;
-    
-    // Lock if using shared file
-    if (fd >= 0) {
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = sizeof(AtomWarehouse);
+        if (!atomic_load(&running))
+            break; // Check if we need to exit
 
-        fcntl(fd, F_SETLKW, &lock); // Lock the file for reading
-    }
+        bool activity = false;
+        unsigned long long wakeup = stats_now();
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
 
-    result = get_amount_to_gen(drink); // Attempt to generate molecules
-    
-    
-    if(fd >= 0) {
-        lock.l_type = F_UNLCK;
-        fcntl(fd, F_SETLKW, &lock); // Unlock the file after reading
-    }
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
 
-    if (result == -1)
-    {
-        printf("Unknown drink type: %s\n", drink);
-        return;
-    }
+            // Release the slot before handling, since handling may submit more work
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
 
-    if (result == 0)
-    {
-        printf("Not enough atoms to generate any %s.\n", drink);
+            if (cqe.user_data == URING_TICK)
+            {
+                uring_arm_tick(&ring);
+                continue;
+            }
+
+            if (cqe.user_data == URING_CANCEL)
+                continue;
+
+            activity = true;
+            handle_uring_completion(&ring, &cqe);
+        }
+
+        if (activity && timeout > 0)
+            alarm(timeout); // Reset the alarm for timeout
+
+        if (activity)
+            stats_lap(&stats.loop, wakeup);
     }
+}
+
+// Entry point of the extra worker threads started by --threads
+void *worker_main(void *arg)
+{
+    Worker *w = arg;
 
+    if (w->uring)
+        run_uring_loop(w->stream_fd, w->dgram_fd, false, w->timeout);
     else
-    {
-        printf("You can generate %d %s.\n", result, drink);
-    }
+        run_epoll_loop(w->stream_fd, w->dgram_fd, false, w->timeout, w->edge_triggered);
+    free_connections(false); // Shared UDS sockets are closed by the main thread
+
+    // Close this worker's own SO_REUSEPORT sockets
+    if (tcp_listener >= 0)
+        close(w->stream_fd);
+    if (udp_listener >= 0)
+        close(w->dgram_fd);
+
+    return NULL;
 }
 
 int main(int argc, char *argv[])
 {
     int tcp_port = -1, udp_port = -1;
     int timeout = -1;
+    EventLoopType loop_type = LOOP_POLL;
+    int threads = 1;
+    const char *stats_spec = NULL; // --stats: a TCP port or a UDS path
     unsigned long long oxygen = 0, carbon = 0, hydrogen = 0;
     bool seen_flags[256] = { false }; // Track seen flags to avoid duplicates
 
+    build_name_index();
+    log_init();
+
     struct option long_options[] = {
         {"tcp-port", required_argument, NULL, 'T'},
         {"udp-port", required_argument, NULL, 'U'},
@@ -568,11 +4112,18 @@ int main(int argc, char *argv[])
         {"stream-path", required_argument, 0, 's'},
         {"datagram-path", required_argument, 0, 'd'},
         {"save-file", required_argument, NULL, 'f'},
+        {"event-loop", required_argument, NULL, 'e'},
+        {"threads", required_argument, NULL, 'n'},
+        {"stats", required_argument, NULL, 'S'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"journal", required_argument, NULL, 'j'},
+        {"sync-mode", required_argument, NULL, 'y'},
+        {"high-water", required_argument, NULL, 'W'},
         {0, 0, 0, 0}};
     
     while (1)
     {
-        int ret = getopt_long(argc, argv, "T:U:o:c:h:t:s:d:f:", long_options, NULL);
+        int ret = getopt_long(argc, argv, "T:U:o:c:h:t:s:d:f:e:n:S:L:j:y:W:", long_options, NULL);
 
         if (ret == -1)
         {
@@ -651,6 +4202,97 @@ int main(int argc, char *argv[])
                 }
             }
             break;
+        case 'e':
+            if (strcmp(optarg, "poll") == 0)
+                loop_type = LOOP_POLL;
+            else if (strcmp(optarg, "epoll") == 0)
+                loop_type = LOOP_EPOLL;
+            else if (strcmp(optarg, "epoll-et") == 0)
+                loop_type = LOOP_EPOLL_ET;
+            else if (strcmp(optarg, "io_uring") == 0)
+                loop_type = LOOP_URING;
+            else
+            {
+                fprintf(stderr, "Invalid event loop: %s (expected poll, epoll, epoll-et or io_uring)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            stats_spec = optarg;
+            break;
+        case 'y':
+        {
+            // none, every, interval[=ms] or batch[=operations]
+            char *value = strchr(optarg, '=');
+            size_t name_len = value ? (size_t)(value - optarg) : strlen(optarg);
+
+            if (strncmp(optarg, "none", name_len) == 0 && name_len == 4)
+                sync_mode = SYNC_NONE;
+            else if (strncmp(optarg, "every", name_len) == 0 && name_len == 5)
+                sync_mode = SYNC_EVERY;
+            else if (strncmp(optarg, "interval", name_len) == 0 && name_len == 8)
+            {
+                sync_mode = SYNC_INTERVAL;
+                sync_arg = value ? atoi(value + 1) : 100;
+            }
+            else if (strncmp(optarg, "batch", name_len) == 0 && name_len == 5)
+            {
+                sync_mode = SYNC_BATCH;
+                sync_arg = value ? atoi(value + 1) : 1000;
+            }
+            else
+                sync_arg = -1;
+
+            if (sync_arg < 0 || ((sync_mode == SYNC_INTERVAL || sync_mode == SYNC_BATCH) && sync_arg == 0))
+            {
+                fprintf(stderr, "Invalid sync mode: %s (expected none, every, interval[=ms] or batch[=operations])\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'j':
+            journal_interval = atoi(optarg);
+            if (journal_interval <= 0)
+            {
+                fprintf(stderr, "Invalid journal interval: %s (expected milliseconds > 0)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W':
+        {
+            // Bytes of replies queued for one stream client before it is no longer read
+            char *end;
+            high_water = strtoull(optarg, &end, 10);
+            if (*end != '\0' || high_water == 0)
+            {
+                fprintf(stderr, "Invalid high-water mark: %s (expected bytes > 0)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'L':
+            if (strcmp(optarg, "error") == 0)
+                log_level = LOG_ERROR;
+            else if (strcmp(optarg, "warn") == 0)
+                log_level = LOG_WARN;
+            else if (strcmp(optarg, "info") == 0)
+                log_level = LOG_INFO;
+            else if (strcmp(optarg, "debug") == 0)
+                log_level = LOG_DEBUG;
+            else
+            {
+                fprintf(stderr, "Invalid log level: %s (expected error, warn, info or debug)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case '?':
             printf("Unknown option: %c\n", optopt);
             exit(EXIT_FAILURE);
@@ -680,6 +4322,36 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (journal_interval && !save_file_path)
+    {
+        printf("Error: --journal requires --save-file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sync_mode != SYNC_NONE && !save_file_path)
+    {
+        printf("Error: --sync-mode requires --save-file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Probe for io_uring once up front, so every thread agrees on the backend
+    if (loop_type == LOOP_URING)
+    {
+        Uring probe;
+
+        if (uring_init(&probe) < 0)
+        {
+            printf("io_uring is not available (%s), falling back to %s\n", strerror(errno), threads > 1 ? "epoll" : "poll");
+            loop_type = LOOP_POLL;
+        }
+        else
+            uring_free(&probe);
+    }
+
+    // Worker threads each run their own epoll loop
+    if (threads > 1 && loop_type == LOOP_POLL)
+        loop_type = LOOP_EPOLL;
+
     // Validate that TCP and UDP ports are not the same
     if (tcp_port != -1 && udp_port != -1 && tcp_port == udp_port) {
         printf("Error: TCP and UDP cannot use the same port.\n");
@@ -701,45 +4373,11 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        tcp_listener = socket(AF_INET, SOCK_STREAM, 0); // Create a TCP socket
+        tcp_listener = open_tcp_listener(tcp_port, threads > 1); // Workers each bind their own socket to the port
 
-        // Check if the socket was created successfully
+        // Check if the listener was created successfully
         if (tcp_listener < 0)
-        {
-            perror("socket");
-            exit(EXIT_FAILURE);
-        }
-
-        // Set socket option to reuse address to avoid "address already in use"
-        int opt = 1;
-        if (setsockopt(tcp_listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
-        {
-            perror("setsockopt");
-            close(tcp_listener);
-            exit(EXIT_FAILURE);
-        }
-
-        struct sockaddr_in tcp_address = {0};        // Initialize the address structure
-        socklen_t tcp_addrlen = sizeof(tcp_address); // Size of the address structure
-        tcp_address.sin_family = AF_INET;            // Set the address family to IPv4
-        tcp_address.sin_addr.s_addr = INADDR_ANY;    // Bind to any available address
-        tcp_address.sin_port = htons(tcp_port);      // Convert the port number to network byte order
-
-        // Bind the socket to the address and port (TCP)
-        if (bind(tcp_listener, (struct sockaddr *)&tcp_address, tcp_addrlen) < 0)
-        {
-            perror("bind");
-            close(tcp_listener); // Close the TCP socket
-            exit(EXIT_FAILURE);
-        }
-
-        // Set the socket to listen for incoming connections (TCP)
-        if (listen(tcp_listener, SOMAXCONN) < 0)
-        { // SOMAXCONN is the maximum queue length for pending connections
-            perror("listen");
-            close(tcp_listener);
             exit(EXIT_FAILURE);
-        }
     }
 
     if (udp_port != -1)
@@ -751,36 +4389,15 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        udp_listener = socket(AF_INET, SOCK_DGRAM, 0); // Create a UDP socket
+        udp_listener = open_udp_socket(udp_port, threads > 1); // Workers each bind their own socket to the port
 
         // Check if the UDP socket was created successfully
         if (udp_listener < 0)
         {
-            perror("socket");
-            if (tcp_listener >= 0)
-            {
-                close(tcp_listener); // Close the TCP socket if UDP socket creation failed
-            }
-            close(udp_listener); // Close the UDP socket
-            exit(EXIT_FAILURE);
-        }
-
-        // For UDP binding, create a new address structure
-        struct sockaddr_in udp_address = {0};        // Initialize UDP address structure
-        socklen_t udp_addrlen = sizeof(udp_address); // Size of the address structure
-        udp_address.sin_family = AF_INET;            // Set the address family to IPv4
-        udp_address.sin_addr.s_addr = INADDR_ANY;    // Bind to any available address
-        udp_address.sin_port = htons(udp_port);      // Use the UDP port number
-
-        // Bind the socket to the address and port (UDP)
-        if (bind(udp_listener, (struct sockaddr *)&udp_address, udp_addrlen) < 0)
-        {
-            perror("bind");
             if (tcp_listener >= 0)
             {
                 close(tcp_listener); // Close the TCP socket if UDP socket creation failed
             }
-            close(udp_listener); // Close the UDP socket
             exit(EXIT_FAILURE);
         }
     }
@@ -897,91 +4514,50 @@ int main(int argc, char *argv[])
     }
 
     if (save_file_path) {
-        fd = open(save_file_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        if (fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
-        }
+        map_save_file();
 
-        AtomWarehouse zero = {0};
-        off_t size = lseek(fd, 0, SEEK_END);  // Move to end to check size
-        if (size < sizeof(AtomWarehouse)) {
-            // File is empty or too small – initialize once
-            lseek(fd, 0, SEEK_SET);
-            write(fd, &zero, sizeof(AtomWarehouse));
-        }
-        lseek(fd, 0, SEEK_SET);  // Always reset to start before mmap
+        if (journal_interval)
+            journal_start();
 
-        warehouse = mmap(NULL, sizeof(AtomWarehouse),
-                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (warehouse == MAP_FAILED) {
-            perror("mmap");
-            close(fd);
-            exit(EXIT_FAILURE);
-        }
+        if (sync_mode == SYNC_INTERVAL)
+            sync_start();
     } 
 
     else {
-        warehouse = malloc(sizeof(AtomWarehouse));
-        warehouse->carbon = carbon;
-        warehouse->oxygen = oxygen;
-        warehouse->hydrogen = hydrogen;
+        // Laid out like a fresh save file, so the cache-line alignment of its members holds
+        warehouse = aligned_alloc(_Alignof(SharedWarehouse), sizeof(SharedWarehouse));
+        if (!warehouse)
+        {
+            perror("aligned_alloc");
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        memset(warehouse, 0, sizeof(SharedWarehouse));
+
+        warehouse->header = (WarehouseHeader){
+            .magic = WAREHOUSE_MAGIC,
+            .version = WAREHOUSE_VERSION,
+            .header_size = sizeof(WarehouseHeader),
+            .file_size = sizeof(SharedWarehouse),
+            .atom_slots = WAREHOUSE_ATOM_SLOTS,
+            .molecule_slots = WAREHOUSE_MOLECULE_SLOTS
+        };
+        atomic_init(&warehouse->seq, 0);
+        pthread_mutex_init(&warehouse->write_lock, NULL);
+        atomic_init(&warehouse->doorbell, 0);
+        atomic_init(&warehouse->doorbell_armed, 0);
+        atomic_init(&warehouse->changes, 0);
+        atomic_init(&warehouse->carbon, carbon);
+        atomic_init(&warehouse->oxygen, oxygen);
+        atomic_init(&warehouse->hydrogen, hydrogen);
+        for (int i = 0; i < WAREHOUSE_ATOM_SLOTS - ATOM_COUNT; i++)
+            atomic_init(&warehouse->atom_ext[i], 0);
     }
 
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    // Allocate memory for the poll file descriptors
-    int fds_capacity = 10;
-    fds = malloc(fds_capacity * sizeof(struct pollfd));
-    if (!fds)
-    {
-        perror("malloc");
-
-        if (tcp_listener >= 0)
-            close(tcp_listener); // Close the TCP listener if it was created
-        else if (stream_path)
-            unlink(stream_path); // Remove the UDS stream socket file if it was created
-
-        if (udp_listener >= 0)
-            close(udp_listener); // Close the UDP listener if it was created
-        else if (datagram_path)
-            unlink(datagram_path); // Remove the UDS datagram socket file if it was created
-
-        exit(EXIT_FAILURE);
-    }
-
-    // Initialize the array to zero out all fields including revents
-    memset(fds, 0, fds_capacity * sizeof(struct pollfd));
-
-    if (tcp_listener >= 0)
-    {
-        fds[0].fd = tcp_listener; // The first element is the listener socket
-        fds[0].events = POLLIN;   // Set the listener to poll for incoming connections
-    }
-
-    else if (uds_stream_listener >= 0)
-    {
-        fds[0].fd = uds_stream_listener; // The fourth element is the UDS stream socket for incoming data
-        fds[0].events = POLLIN;          // Set the UDS stream listener to poll for incoming data
-    }
-
-    if (udp_listener >= 0)
-    {
-        fds[1].fd = udp_listener; // The second element is the UDP socket for incoming data
-        fds[1].events = POLLIN;   // Set the UDP listener to poll for incoming data
-    }
-
-    else if (uds_dgram_fd >= 0)
-    {
-        fds[1].fd = uds_dgram_fd; // The fifth element is the UDS datagram socket for incoming data
-        fds[1].events = POLLIN;   // Set the UDS datagram listener to poll for incoming data
-    }
-
-    fds[2].fd = STDIN_FILENO; // The third element is the standard input for commands
-    fds[2].events = POLLIN;   // Set the stdin to poll for incoming data
-
     printf("drinks_bar server started (Use CTRL+C to shut down):\n");
     if (tcp_listener >= 0)
     {
@@ -1002,6 +4578,35 @@ int main(int argc, char *argv[])
     {
         printf("UDS datagram server started on path: %s\n", datagram_path);
     }
+
+    log_start(); // From here on all output goes through log_msg()
+
+    watcher_start();
+
+    publisher_start();
+
+    if (stats_spec)
+    {
+        pthread_t stats_thread;
+
+        stats_listener = open_stats_listener(stats_spec);
+        if (stats_listener < 0)
+        {
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+
+        stats_enabled = true;
+        if (pthread_create(&stats_thread, NULL, stats_main, NULL) != 0)
+        {
+            perror("pthread_create");
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(stats_thread); // Blocked in accept() until the process exits
+
+        log_msg(LOG_INFO, "Stats server started on: %s", stats_spec);
+    }
     print_status(); // Print the initial status of the warehouse
 
     if (timeout > 0)
@@ -1010,117 +4615,75 @@ int main(int argc, char *argv[])
         alarm(timeout);
     }
 
-    // Main loop to accept and handle client connections
-    while (running)
+    // Start the extra workers; the main thread becomes worker 0
+    Worker *workers = NULL;
+    if (threads > 1)
     {
-        int ready = poll(fds, nfds, 1000); // Poll with a timeout so we can check running flag
-
-        if (!running)
-            break; // Check if we need to exit
-
-        // Check if poll was successful
-        if (ready < 0)
+        workers = calloc(threads, sizeof(Worker));
+        if (!workers)
         {
-            perror("poll");
-            continue;
+            perror("calloc");
+            cleanup();
+            exit(EXIT_FAILURE);
         }
 
-        static AtomWarehouse prev_snapshot = {0};
-        static int first_time = 1;
-
-        if (first_time) {
-            prev_snapshot = *warehouse;
-            first_time = 0;
-        }
-        
-        else if (memcmp(&prev_snapshot, warehouse, sizeof(AtomWarehouse)) != 0) {
-            printf("[Update detected] Warehouse changed\n");
-            print_status();
-            prev_snapshot = *warehouse;
-        }
+        // Several loops wait on the shared UDS sockets, so a loser of the race must not block
+        if (uds_stream_listener >= 0)
+            set_non_blocking(uds_stream_listener);
+        if (uds_dgram_fd >= 0)
+            set_non_blocking(uds_dgram_fd);
 
-        // Check if the TCP or UDS stream listener socket has incoming connections
-        if (fds[0].revents & POLLIN)
+        for (int i = 1; i < threads; i++)
         {
-            if (timeout > 0)
-                alarm(timeout);                            // Reset the alarm for timeout
-            int client_fd = accept(fds[0].fd, NULL, NULL); // Accept a new client connection
+            Worker *w = &workers[i];
+            w->timeout = timeout;
+            w->edge_triggered = (loop_type == LOOP_EPOLL_ET);
+            w->uring = (loop_type == LOOP_URING);
 
-            // Check if the accept was successful
-            if (client_fd < 0)
+            // TCP and UDP get a SO_REUSEPORT socket per worker so the kernel balances them,
+            // UDS sockets cannot be duplicated this way and are shared by all workers
+            w->stream_fd = (tcp_listener >= 0) ? open_tcp_listener(tcp_port, true) : uds_stream_listener;
+            w->dgram_fd = (udp_listener >= 0) ? open_udp_socket(udp_port, true) : uds_dgram_fd;
+
+            if (w->stream_fd < 0 || w->dgram_fd < 0)
             {
-                perror("accept");
-                continue;
+                cleanup();
+                exit(EXIT_FAILURE);
             }
 
-            // Resize the array if we're out of space
-            if (nfds >= fds_capacity)
+            if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
             {
-                fds_capacity *= 2; // Double the capacity
-                struct pollfd *new_fds = realloc(fds, fds_capacity * sizeof(struct pollfd));
-                if (!new_fds)
-                {
-                    perror("realloc");
-                    close(client_fd);
-                    continue;
-                }
-                fds = new_fds;
+                perror("pthread_create");
+                cleanup();
+                exit(EXIT_FAILURE);
             }
-
-            // Add the new client to the end of the array
-            fds[nfds].fd = client_fd;
-            fds[nfds].events = POLLIN;
-            nfds++;
-        }
-
-        // Check if the UDP listener socket has incoming connections
-        if (fds[1].revents & POLLIN && udp_listener >= 0)
-        {
-            if (timeout > 0)
-                alarm(timeout); // Reset the alarm for timeout
-            handle_udp_client(udp_listener);
-        }
-
-        // Check if the UDS stream listener socket has incoming connections
-        else if (fds[1].revents & POLLIN && uds_dgram_fd >= 0)
-        {
-            if (timeout > 0)
-                alarm(timeout); // Reset the alarm for timeout
-            handle_uds_datagram_client(uds_dgram_fd);
         }
 
-        // Check if the stdin has data to read
-        if (fds[2].revents & POLLIN)
-        {
-            if (timeout > 0)
-                alarm(timeout); // Reset the alarm for timeout
-            handle_stdin();
-        }
+        log_msg(LOG_INFO, "Running %d worker threads", threads);
+    }
 
-        // Iterate through the file descriptors to handle client requests
-        for (int i = 3; i < nfds; i++)
-        {
-            // Check if this fd has data to read
-            if (fds[i].revents & POLLIN)
-            {
-                alarm(timeout);
-                int connection_closed = handle_tcp_or_uds_stream_client(fds[i].fd); // Handle the client request
+    if (loop_type == LOOP_POLL)
+        run_poll_loop(timeout);
+    else if (loop_type == LOOP_URING)
+        run_uring_loop(tcp_listener >= 0 ? tcp_listener : uds_stream_listener,
+                       udp_listener >= 0 ? udp_listener : uds_dgram_fd,
+                       true, timeout);
+    else
+        run_epoll_loop(tcp_listener >= 0 ? tcp_listener : uds_stream_listener,
+                       udp_listener >= 0 ? udp_listener : uds_dgram_fd,
+                       true, timeout, loop_type == LOOP_EPOLL_ET);
 
-                if (connection_closed)
-                {
-                    // Shift remaining elements to fill the gap
-                    for (int j = i; j < nfds - 1; j++)
-                    {
-                        fds[j] = fds[j + 1];
-                    }
-                    nfds--;
-                    i--; // Adjust index since we removed an element
-                }
-            }
-        }
+    if (workers)
+    {
+        for (int i = 1; i < threads; i++)
+            pthread_join(workers[i].thread, NULL);
+        free(workers);
     }
 
     cleanup(); // Clean up: close all client sockets and free resources
-    printf("\nServer shut down successfully.\n");
+    if (atomic_load(&timed_out))
+        printf("Server shutting down after timeout.\n");
+    else
+        printf("\nServer shut down successfully.\n");
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // ppoll
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,22 +7,329 @@
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include "protocol.h"
 
 #define BUFFER_SIZE 1024
+#define SEND_BACKOFF_NS 1000000LL // Pause after ENOBUFS, which poll() cannot wait out
 
 // Global variables for command line options
 extern int optopt;
 extern char *optarg;
 
+// Monotonic clock in nanoseconds
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Parse a molecule mix such as "WATER=2,GLUCOSE=1" into a repeating pattern of molecule names
+int parse_mix(char *mix, const char **pattern, int max_pattern) {
+    int len = 0;
+
+    for (char *item = strtok(mix, ","); item; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        int weight = 1;
+
+        if (eq) {
+            *eq = '\0';
+            weight = atoi(eq + 1);
+        }
+
+        for (int i = 0; i < weight && len < max_pattern; i++)
+            pattern[len++] = item;
+    }
+
+    return len > 0 ? len : -1;
+}
+
+// Text equivalent of each binary reply status
+static const char *const status_text[] = {
+    [STATUS_DELIVERED] = "DELIVERED",
+    [STATUS_NOT_ENOUGH_ATOMS] = "NOT ENOUGH ATOMS",
+    [STATUS_UNKNOWN_MOLECULE] = "ERROR: Unknown molecule type",
+    [STATUS_INVALID_COMMAND] = "ERROR: Invalid command",
+    [STATUS_UNKNOWN_DRINK] = "ERROR: Unknown drink type",
+};
+
+int find_molecule(const char *name) {
+    for (int i = 0; i < MOLECULE_COUNT; i++) {
+        if (strcmp(name, molecule_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Encode "DELIVER <MOLECULE> <amount>[, <MOLECULE> <amount>...]" as binary frames, one per item,
+// all with the same request id; returns the total size or -1 if it is not a valid DELIVER
+int encode_binary_deliver(const char *message, uint32_t request_id, BinaryFrame *frames) {
+    char command[16];
+    int consumed = 0, count = 0;
+
+    if (sscanf(message, "%15s%n", command, &consumed) != 1 || strcmp(command, "DELIVER") != 0)
+        return -1;
+    message += consumed;
+
+    while (count < MAX_ORDER_ITEMS) {
+        char molecule[32];
+        unsigned long long amount;
+
+        if (sscanf(message, " %31[^0-9,] %llu%n", molecule, &amount, &consumed) != 2)
+            return -1;
+        message += consumed;
+
+        // Trim trailing spaces from molecule name
+        int len = strlen(molecule);
+        while (len > 0 && molecule[len - 1] == ' ')
+            molecule[--len] = '\0';
+
+        int id = find_molecule(molecule);
+        if (id < 0)
+            return -1;
+
+        BinaryFrame *frame = &frames[count++];
+        memset(frame, 0, sizeof(*frame));
+        frame->magic = BINARY_MAGIC;
+        frame->opcode = OP_DELIVER;
+        frame->item = id;
+        frame->request_id = htole32(request_id);
+        frame->amount = htole64(amount);
+
+        while (*message == ' ')
+            message++;
+        if (*message != ',')
+            return count * sizeof(BinaryFrame);
+        message++;
+    }
+
+    return -1; // Too many items
+}
+
+// Encode "GEN <DRINK>" as a binary frame; returns the frame size or -1 if it is not a valid GEN
+int encode_binary_gen(const char *message, uint32_t request_id, BinaryFrame *frame) {
+    if (strncmp(message, "GEN ", 4) != 0)
+        return -1;
+
+    const char *drink = message + 4 + strspn(message + 4, " ");
+    size_t len = strlen(drink);
+    while (len > 0 && drink[len - 1] == ' ')
+        len--;
+
+    for (int id = 0; id < DRINK_COUNT; id++) {
+        if (strlen(drink_names[id]) == len && strncmp(drink, drink_names[id], len) == 0) {
+            memset(frame, 0, sizeof(*frame));
+            frame->magic = BINARY_MAGIC;
+            frame->opcode = OP_GEN;
+            frame->item = id;
+            frame->request_id = htole32(request_id);
+            return sizeof(*frame);
+        }
+    }
+    return -1;
+}
+
+// Turn a binary reply into its text form; returns the request id or -1 if it is not a reply frame
+long long decode_binary_reply(const char *response, int bytes, char *text, size_t text_size) {
+    BinaryFrame frame;
+
+    if (bytes != sizeof(frame) || (unsigned char)response[0] != BINARY_MAGIC)
+        return -1;
+
+    memcpy(&frame, response, sizeof(frame));
+    if (frame.opcode != OP_REPLY || frame.item > STATUS_UNKNOWN_DRINK)
+        return -1;
+
+    snprintf(text, text_size, "%s", status_text[frame.item]);
+    return le32toh(frame.request_id);
+}
+
+// Load generator: keeps up to `in_flight` DELIVER requests outstanding, each tagged with
+// "#<id>" so replies can be matched even when they arrive out of order. Requests without a
+// reply after `timeout_ms` are counted as lost and free their slot.
+int run_load_mode(int sockfd, struct sockaddr *addr, socklen_t addr_len,
+                  long long count, int in_flight, int timeout_ms, char *mix, unsigned long long amount, bool binary) {
+    const char *pattern[64];
+    int pattern_len = parse_mix(mix, pattern, 64);
+    if (pattern_len < 0) {
+        fprintf(stderr, "Error: Invalid molecule mix\n");
+        return EXIT_FAILURE;
+    }
+
+    int pattern_ids[64];
+    for (int i = 0; i < pattern_len; i++) {
+        pattern_ids[i] = find_molecule(pattern[i]);
+        if (binary && pattern_ids[i] < 0) {
+            fprintf(stderr, "Error: Unknown molecule '%s' for the binary protocol\n", pattern[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    long long *sent_at = malloc(count * sizeof(long long)); // Send time per request id, -1 once answered or lost
+    long long *latencies = malloc(count * sizeof(long long));
+    if (!sent_at || !latencies) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    long long next_id = 0, oldest = 0, outstanding = 0, answered = 0;
+    long long delivered = 0, not_enough = 0, errors = 0, lost = 0;
+    long long timeout_ns = timeout_ms * 1000000LL;
+    char message[BUFFER_SIZE], response[BUFFER_SIZE];
+
+    printf("Sending %lld DELIVER requests with up to %d in flight\n", count, in_flight);
+    long long start = now_ns();
+
+    while (oldest < count) {
+        bool blocked = false, no_buffers = false; // Why the window stopped filling early
+
+        // Fill the window
+        while (next_id < count && outstanding < in_flight) {
+            int len;
+            if (binary) {
+                BinaryFrame frame = {
+                    .magic = BINARY_MAGIC,
+                    .opcode = OP_DELIVER,
+                    .item = pattern_ids[next_id % pattern_len],
+                    .request_id = htole32(next_id),
+                    .amount = htole64(amount)
+                };
+                memcpy(message, &frame, sizeof(frame));
+                len = sizeof(frame);
+            }
+            else
+                len = snprintf(message, sizeof(message), "DELIVER %s %llu #%lld",
+                               pattern[next_id % pattern_len], amount, next_id);
+
+            sent_at[next_id] = now_ns();
+            if (sendto(sockfd, message, len, MSG_DONTWAIT, addr, addr_len) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = true; // Socket buffer full, wait for replies or room
+                    break;
+                }
+                if (errno == ENOBUFS) {
+                    no_buffers = true; // Nothing to poll for, back off for a while
+                    break;
+                }
+                perror("sendto");
+                return EXIT_FAILURE;
+            }
+            next_id++;
+            outstanding++;
+        }
+
+        // Wait for a reply, at most until the oldest outstanding request expires
+        long long now = now_ns();
+        long long wait_ns = (outstanding > 0) ? sent_at[oldest] + timeout_ns - now : 0;
+        if (wait_ns < 0) wait_ns = 0;
+        if (no_buffers && wait_ns < SEND_BACKOFF_NS) wait_ns = SEND_BACKOFF_NS;
+        struct timespec wait = { .tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000 };
+        struct pollfd pfd = { .fd = sockfd, .events = blocked ? POLLIN | POLLOUT : POLLIN };
+
+        // Blocked with nothing outstanding: only room in the socket buffer ends the wait
+        bool bounded = outstanding > 0 || no_buffers;
+        if ((bounded || blocked) && ppoll(&pfd, 1, bounded ? &wait : NULL, NULL) < 0) {
+            perror("ppoll");
+            return EXIT_FAILURE;
+        }
+
+        // Drain every reply that is already queued
+        while (1) {
+            int bytes = recv(sockfd, response, sizeof(response) - 1, MSG_DONTWAIT);
+            if (bytes <= 0)
+                break;
+            response[bytes] = '\0';
+
+            long long id;
+            if (binary) {
+                char text[64];
+                id = decode_binary_reply(response, bytes, text, sizeof(text));
+                strcpy(response, text);
+            }
+            else {
+                char *tag = strrchr(response, '#');
+                id = tag ? atoll(tag + 1) : -1;
+            }
+
+            if (id < 0 || id >= next_id || sent_at[id] < 0)
+                continue; // Untagged, or a late reply to a request already counted as lost
+
+            latencies[answered++] = now_ns() - sent_at[id];
+            sent_at[id] = -1;
+            outstanding--;
+
+            if (strncmp(response, "DELIVERED", 9) == 0)
+                delivered++;
+            else if (strncmp(response, "NOT ENOUGH ATOMS", 16) == 0)
+                not_enough++;
+            else
+                errors++;
+        }
+
+        // Expire requests that waited too long; ids are sent in order, so only the oldest can be due
+        now = now_ns();
+        while (oldest < next_id && (sent_at[oldest] < 0 || sent_at[oldest] + timeout_ns <= now)) {
+            if (sent_at[oldest] >= 0) {
+                sent_at[oldest] = -1;
+                outstanding--;
+                lost++;
+            }
+            oldest++;
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("Completed %lld requests in %.3f s: %.0f requests/s\n", count, elapsed, count / elapsed);
+    printf("DELIVERED: %lld (%.2f%%)  NOT ENOUGH ATOMS: %lld (%.2f%%)  errors: %lld  lost: %lld\n",
+           delivered, 100.0 * delivered / count, not_enough, 100.0 * not_enough / count, errors, lost);
+
+    if (answered > 0) {
+        qsort(latencies, answered, sizeof(long long), compare_ll);
+        printf("Latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               latencies[(long long)(answered * 0.50)] / 1e3,
+               latencies[(long long)(answered * 0.99)] / 1e3,
+               latencies[(long long)(answered * 0.999)] / 1e3,
+               latencies[answered - 1] / 1e3);
+    }
+
+    free(sent_at);
+    free(latencies);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     const char *hostname = NULL;
     const char *port = NULL;
     char *uds_path = NULL;
     bool seen_flags[256] = { false }; // Track seen flags to avoid duplicates
+    long long count = 0; // Number of requests to send in load mode (0 = interactive)
+    int in_flight = 1, timeout_ms = 1000;
+    unsigned long long amount = 1;
+    char *mix = NULL;
+    bool binary = false; // Speak the binary protocol instead of text
+
+    struct option long_options[] = {
+        {"count", required_argument, NULL, 'n'},
+        {"in-flight", required_argument, NULL, 'i'},
+        {"timeout-ms", required_argument, NULL, 'w'},
+        {"mix", required_argument, NULL, 'm'},
+        {"amount", required_argument, NULL, 'a'},
+        {"binary", no_argument, NULL, 'b'},
+        {0, 0, 0, 0}};
 
     while (1) {
-        int ret = getopt(argc, argv, "h:p:f:");
+        int ret = getopt_long(argc, argv, "h:p:f:n:i:w:m:a:b", long_options, NULL);
 
         if (ret == -1)
         {
@@ -55,8 +363,27 @@ int main(int argc, char *argv[]) {
                     }
                 }
                 break;
+            case 'n':
+                count = atoll(optarg);
+                break;
+            case 'i':
+                in_flight = atoi(optarg);
+                break;
+            case 'w':
+                timeout_ms = atoi(optarg);
+                break;
+            case 'm':
+                mix = strdup(optarg);
+                break;
+            case 'a':
+                amount = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                binary = true;
+                break;
             case '?':
                 printf("Usage: %s [-h <hostname/IP> -p <port>] | [-f <uds_path>]\n", argv[0]);
+                printf("Load mode: [--count N] [--in-flight N] [--timeout-ms MS] [--mix WATER=1,GLUCOSE=1] [--amount N] [--binary]\n");
                 exit(EXIT_FAILURE);
         }
     }
@@ -133,10 +460,20 @@ int main(int argc, char *argv[]) {
     }
     
     char message[BUFFER_SIZE]; // Buffer to hold the message to send
+    int ret = 0;
+
+    if (count > 0) {
+        if (in_flight < 1 || timeout_ms < 1) {
+            fprintf(stderr, "Error: --in-flight and --timeout-ms must be >= 1\n");
+            exit(EXIT_FAILURE);
+        }
+        ret = run_load_mode(sockfd, (struct sockaddr *)&addr, addr_len, count, in_flight, timeout_ms,
+                            mix ? mix : strdup("WATER=1"), amount, binary);
+    }
 
     // Main loop to read commands from the user
-    while (1) {
-        printf("Enter a command (e.g., DELIVER WATER 3) or type \"q\" to quit:\n> ");
+    while (count == 0) {
+        printf("Enter a command (e.g., DELIVER WATER 3, DELIVER WATER 3, GLUCOSE 2 or GEN VODKA) or type \"q\" to quit:\n> ");
         
         if (!fgets(message, BUFFER_SIZE, stdin)) break; // Read user input (break on EOF)
 
@@ -145,8 +482,24 @@ int main(int argc, char *argv[]) {
         if (len > 0 && message[len - 1] == '\n') message[len - 1] = '\0';
         if (strcasecmp(message, "q") == 0) break; // Exit if the user types "q"
 
+        size_t message_len = strlen(message);
+
+        if (binary) {
+            // Encode the command as frames instead of sending the text
+            BinaryFrame frames[MAX_ORDER_ITEMS];
+            int size = encode_binary_gen(message, 0, frames);
+            if (size < 0)
+                size = encode_binary_deliver(message, 0, frames);
+            if (size < 0) {
+                fprintf(stderr, "Invalid command for the binary protocol (expected DELIVER <MOLECULE> <amount>[, ...] or GEN <DRINK>)\n");
+                continue;
+            }
+            memcpy(message, frames, size);
+            message_len = size;
+        }
+
         // Send the message and receive response
-        if (sendto(sockfd, message, strlen(message), 0, (struct sockaddr*)&addr, addr_len) < 0) {
+        if (sendto(sockfd, message, message_len, 0, (struct sockaddr*)&addr, addr_len) < 0) {
             perror("sendto");
             continue;
         }
@@ -162,7 +515,20 @@ int main(int argc, char *argv[]) {
             // Check if the response was received successfully
             if (bytes_received > 0) {
                 response[bytes_received] = '\0';
-                printf("Server response: %s\n", response);
+
+                char text[64];
+                if (binary && decode_binary_reply(response, bytes_received, text, sizeof(text)) >= 0) {
+                    // A successful GEN carries the number of drinks in the amount field
+                    // (message still holds the request frame, so its opcode tells)
+                    BinaryFrame request, reply;
+                    memcpy(&request, message, sizeof(request));
+                    memcpy(&reply, response, sizeof(reply));
+                    if (request.opcode == OP_GEN && reply.item == STATUS_DELIVERED)
+                        snprintf(text, sizeof(text), "%llu", (unsigned long long)le64toh(reply.amount));
+                    printf("Server response: %s\n", text);
+                }
+                else
+                    printf("Server response: %s\n", response);
             }
         }
     }
@@ -179,5 +545,5 @@ int main(int argc, char *argv[]) {
 
     printf("Closing connection to server.\n");
     close(sockfd); // Close the socket
-    return 0;
+    return ret;
 }
\ No newline at end of file
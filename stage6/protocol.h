@@ -0,0 +1,49 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Binary framing, spoken alongside the text protocol on every listener.
+// Each frame starts with BINARY_MAGIC, a byte that can never start a text command,
+// so the server tells the two apart per message. Multi-byte fields are little-endian.
+#define BINARY_MAGIC 0xB1
+
+enum { OP_ADD = 1, OP_DELIVER = 2, OP_REPLY = 3, OP_GEN = 4 };
+
+enum { ATOM_CARBON, ATOM_OXYGEN, ATOM_HYDROGEN, ATOM_COUNT };
+
+enum { MOLECULE_WATER, MOLECULE_CARBON_DIOXIDE, MOLECULE_ALCOHOL, MOLECULE_GLUCOSE, MOLECULE_COUNT };
+
+enum { DRINK_SOFT_DRINK, DRINK_VODKA, DRINK_CHAMPAGNE, DRINK_COUNT };
+
+// OP_ADD frames on a stream: this frame and the next one belong to the same batch,
+// which is applied as one update. A batch has at most MAX_ADD_ITEMS frames.
+#define FRAME_MORE 0x01
+#define MAX_ADD_ITEMS 8
+
+// Reply status, carried in the item field of an OP_REPLY frame. A GEN is answered with
+// STATUS_DELIVERED and the number of drinks that can be made in the amount field.
+enum { STATUS_DELIVERED, STATUS_NOT_ENOUGH_ATOMS, STATUS_UNKNOWN_MOLECULE, STATUS_INVALID_COMMAND, STATUS_UNKNOWN_DRINK };
+
+typedef struct __attribute__((packed))
+{
+    uint8_t magic;       // BINARY_MAGIC
+    uint8_t opcode;      // OP_ADD, OP_DELIVER or OP_REPLY
+    uint8_t item;        // Atom id (ADD), molecule id (DELIVER), drink id (GEN) or status (REPLY)
+    uint8_t flags;       // FRAME_MORE, otherwise zero
+    uint32_t request_id; // Echoed back in the reply
+    uint64_t amount;
+} BinaryFrame;
+
+_Static_assert(sizeof(BinaryFrame) == 16, "BinaryFrame must be 16 bytes on the wire");
+
+// Most items in one DELIVER order: comma separated items of a text request, or DELIVER
+// frames sharing a request id in one datagram. The order is delivered all or nothing.
+#define MAX_ORDER_ITEMS 8
+
+// Names used by the text protocol, indexed by the ids above
+static const char *const atom_names[ATOM_COUNT] = { "CARBON", "OXYGEN", "HYDROGEN" };
+static const char *const molecule_names[MOLECULE_COUNT] = { "WATER", "CARBON DIOXIDE", "ALCOHOL", "GLUCOSE" };
+static const char *const drink_names[DRINK_COUNT] = { "SOFT DRINK", "VODKA", "CHAMPAGNE" };
+
+#endif